@@ -0,0 +1,509 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * espeak hands us its PCM through the synth callback, and we play it
+ * ourselves.  That way the volume can be applied by a gain stage on the
+ * samples on their way to the device, so that a volume change is heard
+ * on the audio which is currently playing rather than on the next
+ * utterance.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "espeakup.h"
+
+/*
+ * name of the ALSA pcm device to play on, or "null" to throw the audio
+ * away at the pace it would have been played, for testing
+ */
+char *audioDevice = "default";
+
+/* latency of the device buffer, in microseconds */
+static const unsigned int audioLatency = 50000;
+
+/* length of the volume ramp, in milliseconds */
+static const int gainRampMs = 5;
+
+/* gains are Q12 fixed-point numbers */
+#define GAIN_SHIFT 12
+#define GAIN_UNITY (1 << GAIN_SHIFT)
+
+/* length of the silence played to wake the device up on resume, in ms */
+static const int prewarmMs = 10;
+
+/* how often to try opening a device which could not be, in ms */
+static const int reopenIntervalMs = 500;
+
+static snd_pcm_t *pcm = NULL;
+static snd_pcm_uframes_t write_chunk;
+
+/* the null sink, and when what it has been given would be done playing */
+static int null_sink = 0;
+static long long null_end = 0;
+
+static int audio_rate = 0;
+
+/*
+ * When a device which could not be opened, or stopped taking samples,
+ * is next to be tried again by audio_write.  Speech is lost meanwhile,
+ * but comes back with the device, unplugged and plugged in again say.
+ */
+static long long reopen_after = 0;
+static int device_lost = 0;
+
+/*
+ * the WAV file sink of --render, which takes the samples as fast as
+ * they are synthesized, and how many it has been given
+ */
+static int file_fd = -1;
+static long long file_frames;
+
+/* size of the WAV header written by wav_header */
+#define WAV_HEADER_SIZE 44
+
+/*
+ * After a pause, the device is reopened by a separate thread while the
+ * espeak thread gets on with synthesizing.  audio_opening is set while
+ * that is going on, and audio_write waits for it to finish.
+ */
+static pthread_mutex_t audio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t audio_ready = PTHREAD_COND_INITIALIZER;
+static int audio_opening = 0;
+static long long resume_start;
+
+/*
+ * If set, the null sink hands every block of samples to this, with the
+ * time its first sample would be heard, and calls it with no samples
+ * when what it had been given is dropped.  This lets benchmarks see
+ * when speech would come out.
+ */
+void (*audio_tap)(const short *wav, int n, long long when, int rate) = NULL;
+
+/* how long the last resume took to get the device ready, in microseconds */
+long audio_resume_us = 0;
+
+static int gain_target = GAIN_UNITY;
+static int gain_current = GAIN_UNITY;
+static int gain_step = 1;
+
+static inline short clip_sample(int v)
+{
+	if (v > 32767)
+		return 32767;
+	if (v < -32768)
+		return -32768;
+	return v;
+}
+
+/* Multiply n samples by a constant gain, saturating. */
+static void gain_apply_constant(short *wav, int n, int gain)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i g = _mm_set1_epi16(gain);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((__m128i *) (wav + i));
+		__m128i lo = _mm_mullo_epi16(x, g);
+		__m128i hi = _mm_mulhi_epi16(x, g);
+		__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), GAIN_SHIFT);
+		__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), GAIN_SHIFT);
+		_mm_storeu_si128((__m128i *) (wav + i), _mm_packs_epi32(a, b));
+	}
+#endif
+	for (; i < n; i++)
+		wav[i] = clip_sample((wav[i] * gain) >> GAIN_SHIFT);
+}
+
+/*
+ * Apply the current gain to a block of samples.  When the target gain
+ * has changed, move towards it linearly over gainRampMs so that the
+ * change does not click.
+ */
+static void gain_apply(short *wav, int n)
+{
+	int target = __atomic_load_n(&gain_target, __ATOMIC_RELAXED);
+	int i = 0;
+
+	while (gain_current != target && i < n) {
+		if (gain_current < target) {
+			gain_current += gain_step;
+			if (gain_current > target)
+				gain_current = target;
+		} else {
+			gain_current -= gain_step;
+			if (gain_current < target)
+				gain_current = target;
+		}
+		wav[i] = clip_sample((wav[i] * gain_current) >> GAIN_SHIFT);
+		i++;
+	}
+	if (gain_current != GAIN_UNITY)
+		gain_apply_constant(wav + i, n - i, gain_current);
+}
+
+/*
+ * Set the gain as a fraction num / den of the level espeak synthesizes
+ * at.  May be called from any thread; the playback path picks the new
+ * value up on its next block.
+ */
+void audio_set_gain(int num, int den)
+{
+	int gain;
+
+	if (num < 0)
+		num = 0;
+	gain = num * GAIN_UNITY / den;
+	/* The SIMD path multiplies by a signed 16-bit gain. */
+	if (gain > 32767)
+		gain = 32767;
+	__atomic_store_n(&gain_target, gain, __ATOMIC_RELAXED);
+}
+
+/* Write all of buf to fd. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void put_le(unsigned char *p, unsigned int v, int bytes)
+{
+	while (bytes--) {
+		*p++ = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+ * The header of a mono 16-bit WAV file holding frames samples.  The
+ * sizes are left at their maximum when not known yet, which is what
+ * readers of a WAV stream expect.
+ */
+static void wav_header(unsigned char *h, int rate, long long frames)
+{
+	unsigned int data = 0xffffffff;
+
+	if (frames >= 0 && frames * 2 <= 0xffffffffLL - WAV_HEADER_SIZE)
+		data = frames * 2;
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, data == 0xffffffff ? data : data + WAV_HEADER_SIZE - 8, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, 1, 2);		/* PCM */
+	put_le(h + 22, 1, 2);		/* mono */
+	put_le(h + 24, rate, 4);
+	put_le(h + 28, rate * 2, 4);
+	put_le(h + 32, 2, 2);
+	put_le(h + 34, 16, 2);
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, data, 4);
+}
+
+/*
+ * Make audio_open write a WAV file to fd instead of opening a device.
+ * The samples go in host byte order, which WAV expects to be little
+ * endian.  The file stays open across pauses, until audio_close_file.
+ */
+void audio_open_file(int fd)
+{
+	file_fd = fd;
+	file_frames = 0;
+}
+
+/*
+ * Finish the WAV file, filling in its sizes if it can seek back to its
+ * header.  Returns how many seconds of audio it holds.
+ */
+double audio_close_file(void)
+{
+	unsigned char h[WAV_HEADER_SIZE];
+	double seconds = 0;
+
+	if (file_fd < 0)
+		return 0;
+	if (audio_rate) {
+		seconds = (double) file_frames / audio_rate;
+		if (lseek(file_fd, 0, SEEK_SET) == 0) {
+			wav_header(h, audio_rate, file_frames);
+			if (write_all(file_fd, h, sizeof(h)) < 0)
+				perror("Unable to write the WAV header");
+		}
+	}
+	file_fd = -1;
+	return seconds;
+}
+
+int audio_open(int rate)
+{
+	unsigned char h[WAV_HEADER_SIZE];
+	int err;
+
+	if (pcm || null_sink)
+		return 0;
+	audio_rate = rate;
+	if (file_fd >= 0) {
+		wav_header(h, rate, -1);
+		if (write_all(file_fd, h, sizeof(h)) < 0) {
+			perror("Unable to write the WAV header");
+			return -1;
+		}
+		goto opened;
+	}
+	if (!strcmp(audioDevice, "null")) {
+		null_sink = 1;
+		null_end = 0;
+		goto opened;
+	}
+	err = snd_pcm_open(&pcm, audioDevice, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0) {
+		pcm = NULL;
+		goto failed;
+	}
+	err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16,
+							 SND_PCM_ACCESS_RW_INTERLEAVED, 1, rate, 1,
+							 audioLatency);
+	if (err < 0) {
+		snd_pcm_close(pcm);
+		pcm = NULL;
+		goto failed;
+	}
+	if (device_lost && debug)
+		fprintf(stderr, "Audio device %s is back\n", audioDevice);
+	device_lost = 0;
+opened:
+	/* Hand the device at most 10 ms at a time, see audio_write. */
+	write_chunk = rate / 100;
+	gain_step = GAIN_UNITY / (rate * gainRampMs / 1000);
+	if (gain_step < 1)
+		gain_step = 1;
+	gain_current = __atomic_load_n(&gain_target, __ATOMIC_RELAXED);
+	return 0;
+
+failed:
+	/* Said once, not every time it is tried again. */
+	if (!device_lost)
+		fprintf(stderr, "Unable to open audio device %s: %s\n",
+				audioDevice, snd_strerror(err));
+	device_lost = 1;
+	reopen_after = now_ns() + reopenIntervalMs * 1000000LL;
+	recorder_log(EV_ERROR, FLIGHT_ERR_AUDIO, err);
+	return -1;
+}
+
+static void wait_for_device(void)
+{
+	pthread_mutex_lock(&audio_lock);
+	while (audio_opening)
+		pthread_cond_wait(&audio_ready, &audio_lock);
+	pthread_mutex_unlock(&audio_lock);
+}
+
+void audio_close(void)
+{
+	wait_for_device();
+	/* A pause does not end the WAV file, see audio_close_file. */
+	if (file_fd >= 0)
+		return;
+	null_sink = 0;
+	if (!pcm)
+		return;
+	snd_pcm_drop(pcm);
+	snd_pcm_close(pcm);
+	pcm = NULL;
+}
+
+static void *resume_thread(void *arg)
+{
+	short silence[audio_rate * prewarmMs / 1000];
+	snd_pcm_sframes_t n;
+
+	if (audio_open(audio_rate) == 0 && pcm) {
+		/* Get the device running, so that the first words after
+		 * the resume are not clipped or delayed. */
+		memset(silence, 0, sizeof(silence));
+		n = snd_pcm_writei(pcm, silence, sizeof(silence) / sizeof(short));
+		if (n < 0)
+			snd_pcm_recover(pcm, n, 1);
+	}
+	pthread_mutex_lock(&audio_lock);
+	audio_resume_us = (now_ns() - resume_start) / 1000;
+	audio_opening = 0;
+	pthread_cond_broadcast(&audio_ready);
+	pthread_mutex_unlock(&audio_lock);
+	if (debug)
+		fprintf(stderr, "Audio device resumed in %ld us\n",
+				audio_resume_us);
+	return NULL;
+}
+
+/*
+ * Reopen the device after a pause, without waiting for it.
+ * The first audio_write will wait for it if needed.
+ */
+void audio_resume(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	wait_for_device();
+	if (pcm || null_sink || file_fd >= 0 || !audio_rate)
+		return;
+	resume_start = now_ns();
+	pthread_mutex_lock(&audio_lock);
+	audio_opening = 1;
+	pthread_mutex_unlock(&audio_lock);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, resume_thread, NULL) != 0) {
+		pthread_mutex_lock(&audio_lock);
+		audio_opening = 0;
+		pthread_mutex_unlock(&audio_lock);
+		audio_open(audio_rate);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Throw away whatever is still buffered in the device. */
+void audio_drop(void)
+{
+	wait_for_device();
+	if (null_sink && audio_tap)
+		audio_tap(NULL, 0, now_ns(), audio_rate);
+	null_end = 0;
+	if (!pcm)
+		return;
+	snd_pcm_drop(pcm);
+	snd_pcm_prepare(pcm);
+}
+
+/*
+ * When the next sample handed to audio_write will be heard, from what
+ * the device has yet to play.
+ */
+long long audio_play_time(void)
+{
+	snd_pcm_sframes_t delay;
+	long long now;
+
+	/* Not while resume_thread is opening and priming the device. */
+	wait_for_device();
+	now = now_ns();
+	if (null_sink)
+		return null_end > now ? null_end : now;
+	if (pcm && audio_rate && snd_pcm_delay(pcm, &delay) == 0 && delay > 0)
+		return now + delay * 1000000000LL / audio_rate;
+	return now;
+}
+
+/*
+ * The null sink takes samples as fast as a device with a buffer of
+ * audioLatency would.
+ */
+static void null_play(const short *wav, int frames)
+{
+	long long now = now_ns();
+	long long until;
+
+	if (null_end < now)
+		null_end = now;
+	if (audio_tap)
+		audio_tap(wav, frames, null_end, audio_rate);
+	null_end += frames * 1000000000LL / audio_rate;
+	until = null_end - audioLatency * 1000LL;
+	if (until > now)
+		sleep_until_ns(until);
+}
+
+/*
+ * Play a block of samples, blocking until the device has taken them.
+ * The samples are modified in place by the gain stage.  We give up
+ * early when a stop has been requested, writing in small pieces so that
+ * a flush never waits for long.
+ */
+int audio_write(short *wav, int numsamples)
+{
+	snd_pcm_sframes_t n;
+	snd_pcm_uframes_t len;
+
+	wait_for_device();
+	if (file_fd >= 0) {
+		gain_apply(wav, numsamples);
+		if (write_all(file_fd, wav, numsamples * sizeof(short)) < 0) {
+			perror("Unable to write the WAV file");
+			recorder_log(EV_ERROR, FLIGHT_ERR_AUDIO, errno);
+			return -1;
+		}
+		file_frames += numsamples;
+		return 0;
+	}
+	/* Try the device again, if it was lost, see reopen_after. */
+	if (!pcm && !null_sink
+		&& (!audio_rate || now_ns() < reopen_after
+			|| audio_open(audio_rate) < 0))
+		return -1;
+	gain_apply(wav, numsamples);
+	while (numsamples > 0 && !stop_requested) {
+		len = numsamples;
+		if (len > write_chunk)
+			len = write_chunk;
+		if (null_sink) {
+			null_play(wav, len);
+			n = len;
+		} else
+			n = snd_pcm_writei(pcm, wav, len);
+		if (n < 0) {
+			n = snd_pcm_recover(pcm, n, 1);
+			if (n < 0) {
+				fprintf(stderr, "Unable to write to audio device: %s\n",
+						snd_strerror(n));
+				recorder_log(EV_ERROR, FLIGHT_ERR_AUDIO, n);
+				/* Opened again by the next write. */
+				snd_pcm_close(pcm);
+				pcm = NULL;
+				device_lost = 1;
+				reopen_after = 0;
+				return -1;
+			}
+			continue;
+		}
+		wav += n;
+		numsamples -= n;
+	}
+	return 0;
+}
@@ -0,0 +1,485 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the paths text goes through before espeak: parsing
+ * what is read from the softsynth, the queue, the string routines, and
+ * the language identification of --auto-language.
+ * "make bench" builds and runs them.
+ *
+ * The program is linked with everything but espeakup.c, whose globals
+ * come from harness.c instead, and with malloc and friends wrapped so that
+ * allocations can be counted.  Each benchmark is run with twice as many
+ * operations until it takes long enough to be timed, and printed as one
+ * line of whitespace-separated columns:
+ *   name ops ns_per_op bytes_per_sec allocs_per_op
+ * Work which is not part of what is measured, like emptying the queue
+ * the parsers fill, is left out of the timings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "espeakup.h"
+#include "stringhandling.h"
+
+/* run each benchmark for at least this long, in milliseconds */
+static const int benchMinMs = 200;
+
+/* empty the queues after this many buffers */
+static const int drainEvery = 256;
+
+/*
+ * Allocation counting, see the link flags in the Makefile.
+ */
+static unsigned long allocs = 0;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t n)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(p, n);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_strdup(s);
+}
+
+/*
+ * Corpora.  A corpus is a list of buffers, each standing for one read()
+ * from the softsynth.
+ */
+#define CORPUS_MAX 256
+
+struct corpus_t {
+	char *bufs[CORPUS_MAX];
+	size_t lens[CORPUS_MAX];
+	int count;
+};
+
+static void corpus_add(struct corpus_t *c, const char *buf, size_t len)
+{
+	if (c->count == CORPUS_MAX)
+		return;
+	/* The softsynth thread terminates what it reads. */
+	c->bufs[c->count] = allocMem(len + 1);
+	memcpy(c->bufs[c->count], buf, len);
+	c->bufs[c->count][len] = 0;
+	c->lens[c->count] = len;
+	c->count++;
+}
+
+/* Typing: one character per read, with a line feed now and then. */
+static void make_key_echo(struct corpus_t *c)
+{
+	const char *typed = "ls -l /usr/share/doc | less\n"
+		"grep -rn espeak /etc\ncd ~/src && make\n";
+	const char *p;
+
+	for (p = typed; *p; p++)
+		corpus_add(c, p, 1);
+}
+
+/* A log being dumped to the console: many long lines per read. */
+static void make_log_dump(struct corpus_t *c)
+{
+	char buf[4096];
+	size_t len = 0;
+	int i, n;
+
+	for (i = 0; i < 256; i++) {
+		char line[160];
+
+		n = snprintf(line, sizeof(line),
+					 "[%6d.%06d] usb 1-%d: new high-speed USB device "
+					 "number %d using xhci_hcd\n", 1000 + i, i * 3907,
+					 i % 8, i);
+		if (len + n > sizeof(buf)) {
+			corpus_add(c, buf, len);
+			len = 0;
+		}
+		memcpy(buf + len, line, n);
+		len += n;
+	}
+	if (len)
+		corpus_add(c, buf, len);
+}
+
+/* Screen review: short text with settings changes in between. */
+static void make_mixed(struct corpus_t *c)
+{
+	static const char *const bufs[] = {
+		"\x01" "5s",
+		"\x01" "+1p" "H" "\x01" "-1p" "ello there, this is a line.",
+		"\x01" "3v" "\x01" "2b" "File Edit View Search Terminal Help",
+		"\x01" "+2s",
+		"\x01" "+1p" "W" "\x01" "-1p" "ords and " "\x01" "+1p" "C"
+			"\x01" "-1p" "apitals.\n",
+		"\x01" "-1s",
+		"\x01" "5f" "\x01" "4p" "root@host:~# ",
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++)
+		corpus_add(c, bufs[i], strlen(bufs[i]));
+}
+
+static void drain_queue(struct queue_t *q)
+{
+	struct espeak_entry_t *entry;
+
+	while ((entry = queue_remove(q)) != NULL) {
+		if (q == synth_queue)
+			stats_entry_removed(entry);
+		if (entry->cmd == CMD_SPEAK_TEXT)
+			free(entry->buf);
+		free(entry);
+	}
+}
+
+static void drain_queues(void)
+{
+	pthread_mutex_lock(&queue_guard);
+	drain_queue(synth_queue);
+	drain_queue(live_queue);
+	pthread_mutex_unlock(&queue_guard);
+}
+
+/*
+ * Benchmarks.  Each runs n operations and returns the time they took,
+ * in ns, and the number of bytes they processed.
+ */
+static struct corpus_t key_echo, log_dump, mixed;
+static struct synth_t synth;
+
+static long long run_parser(long n, size_t *bytes, struct corpus_t *c,
+							int acsint)
+{
+	long long elapsed = 0, start;
+	long i = 0;
+	int j;
+
+	*bytes = 0;
+	while (i < n) {
+		start = now_ns();
+		for (j = 0; j < drainEvery && i < n; j++, i++) {
+			int k = i % c->count;
+
+			if (acsint)
+				process_buffer_acsint(&synth, c->bufs[k], c->lens[k]);
+			else
+				process_buffer(&synth, c->bufs[k], c->lens[k]);
+			*bytes += c->lens[k];
+		}
+		elapsed += now_ns() - start;
+		drain_queues();
+	}
+	return elapsed;
+}
+
+static long long bench_speakup_key_echo(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &key_echo, 0);
+}
+
+static long long bench_speakup_log_dump(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &log_dump, 0);
+}
+
+static long long bench_speakup_mixed(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &mixed, 0);
+}
+
+static long long bench_acsint_key_echo(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &key_echo, 1);
+}
+
+static long long bench_acsint_log_dump(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &log_dump, 1);
+}
+
+static long long bench_acsint_mixed(long n, size_t *bytes)
+{
+	return run_parser(n, bytes, &mixed, 1);
+}
+
+/*
+ * queue_add and queue_remove the way the softsynth and espeak threads
+ * use them: under a mutex, the consumer waiting on a condition when the
+ * queue is empty.  One operation is one entry going through.
+ */
+static struct queue_t *contended_queue;
+static pthread_mutex_t contended_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t contended_cond = PTHREAD_COND_INITIALIZER;
+
+static void *queue_producer(void *arg)
+{
+	long n = *(long *) arg;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&contended_lock);
+		queue_add(contended_queue, arg);
+		pthread_cond_signal(&contended_cond);
+		pthread_mutex_unlock(&contended_lock);
+	}
+	return NULL;
+}
+
+static long long bench_queue_contended(long n, size_t *bytes)
+{
+	pthread_t producer;
+	long long start;
+	long i;
+
+	*bytes = 0;
+	contended_queue = new_queue();
+	start = now_ns();
+	if (pthread_create(&producer, NULL, queue_producer, &n) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&contended_lock);
+		while (!queue_remove(contended_queue))
+			pthread_cond_wait(&contended_cond, &contended_lock);
+		pthread_mutex_unlock(&contended_lock);
+	}
+	pthread_join(producer, NULL);
+	start = now_ns() - start;
+	free(contended_queue);
+	return start;
+}
+
+/* Growing a string to 64 KiB by appends of a given size. */
+static long long run_string_grow(long n, size_t *bytes, int size)
+{
+	static const char chunk[1024];
+	const int limit = 64 * 1024;
+	long long start;
+	char *s;
+	int l;
+	long i;
+
+	*bytes = (size_t) n * size;
+	start = now_ns();
+	s = initString(&l);
+	for (i = 0; i < n; i++) {
+		if (l + size > limit) {
+			free(s);
+			s = initString(&l);
+		}
+		stringAndBytes(&s, &l, chunk, size);
+	}
+	if (s != EMPTYSTRING)
+		free(s);
+	return now_ns() - start;
+}
+
+/*
+ * Filling a line of a given size and emptying it, over and over, as the
+ * acsint text accumulator does.
+ */
+static long long run_strbuf_line(long n, size_t *bytes, int size)
+{
+	static const char chunk[1024];
+	struct strbuf_t b = { 0 };
+	long long start;
+	long i;
+
+	*bytes = (size_t) n * size;
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		strbufAppend(&b, chunk, size);
+		strbufClear(&b);
+	}
+	free(b.s);
+	return now_ns() - start;
+}
+
+static long long bench_strbuf_line_64(long n, size_t *bytes)
+{
+	return run_strbuf_line(n, bytes, 64);
+}
+
+static long long bench_string_grow_1(long n, size_t *bytes)
+{
+	return run_string_grow(n, bytes, 1);
+}
+
+static long long bench_string_grow_64(long n, size_t *bytes)
+{
+	return run_string_grow(n, bytes, 64);
+}
+
+static long long bench_string_grow_1024(long n, size_t *bytes)
+{
+	return run_string_grow(n, bytes, 1024);
+}
+
+/*
+ * Lines in the languages --auto-language tells apart, and some it should
+ * leave undetermined, labelled NULL.
+ */
+static const char *const langidLines[][2] = {
+	{"en", "The file could not be opened, please check the permissions."},
+	{"en", "Do you want to save your changes before closing the window?"},
+	{"de", "Die Datei konnte nicht geöffnet werden, bitte prüfen Sie die Rechte."},
+	{"de", "Möchten Sie die Änderungen vor dem Schließen speichern?"},
+	{"fr", "Le fichier n'a pas pu être ouvert, vérifiez les permissions."},
+	{"fr", "Voulez-vous enregistrer les modifications avant de quitter?"},
+	{"es", "No se pudo abrir el archivo, compruebe los permisos del usuario."},
+	{"es", "No sé si el programa todavía se está ejecutando en la máquina."},
+	{"it", "Non è stato possibile aprire il file, controlla i permessi."},
+	{"it", "Vuoi salvare le modifiche prima di uscire?"},
+	{"pt", "Não sei se o programa ainda está em execução no computador."},
+	{"nl", "Het bestand kon niet worden geopend, controleer de rechten."},
+	{"ru", "Не удалось открыть файл, проверьте права доступа."},
+	{"el", "Δεν ήταν δυνατό το άνοιγμα του αρχείου."},
+	{"ja", "ファイルを開けませんでした。"},
+	{"zh", "无法打开文件，请检查权限。"},
+	{NULL, "ls -l /tmp"},
+	{NULL, "Enter"},
+};
+
+#define LANGID_LINES (sizeof(langidLines) / sizeof(langidLines[0]))
+
+static long long bench_langid_line(long n, size_t *bytes)
+{
+	long long start;
+	const char *line;
+	long i;
+
+	*bytes = 0;
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		line = langidLines[i % LANGID_LINES][1];
+		*bytes += strlen(line);
+		identify_language(line, strlen(line));
+	}
+	return now_ns() - start;
+}
+
+/* How many of the lines langid_line goes through it gets right. */
+static void langid_accuracy(void)
+{
+	int right = 0, undetermined = 0, wrong = 0;
+	const char *language;
+	unsigned int i;
+
+	for (i = 0; i < LANGID_LINES; i++) {
+		language = identify_language(langidLines[i][1],
+									 strlen(langidLines[i][1]));
+		if (language == langidLines[i][0]
+			|| (language && langidLines[i][0]
+				&& !strcmp(language, langidLines[i][0])))
+			right++;
+		else if (!language)
+			undetermined++;
+		else
+			wrong++;
+	}
+	printf("# langid: %d right, %d undetermined, %d wrong of %d lines\n",
+		   right, undetermined, wrong, (int) LANGID_LINES);
+}
+
+static const struct {
+	const char *name;
+	long long (*run)(long n, size_t *bytes);
+} benches[] = {
+	{"speakup_key_echo", bench_speakup_key_echo},
+	{"speakup_log_dump", bench_speakup_log_dump},
+	{"speakup_mixed", bench_speakup_mixed},
+	{"acsint_key_echo", bench_acsint_key_echo},
+	{"acsint_log_dump", bench_acsint_log_dump},
+	{"acsint_mixed", bench_acsint_mixed},
+	{"queue_contended", bench_queue_contended},
+	{"string_grow_1", bench_string_grow_1},
+	{"string_grow_64", bench_string_grow_64},
+	{"string_grow_1024", bench_string_grow_1024},
+	{"strbuf_line_64", bench_strbuf_line_64},
+	{"langid_line", bench_langid_line},
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long before;
+	long long elapsed;
+	size_t bytes;
+	unsigned int i;
+	long n;
+
+	synth_queue = new_queue();
+	live_queue = new_queue();
+	synth.volume = 5;
+	make_key_echo(&key_echo);
+	make_log_dump(&log_dump);
+	make_mixed(&mixed);
+
+	printf("# %-18s %10s %10s %14s %13s\n", "name", "ops", "ns_per_op",
+		   "bytes_per_sec", "allocs_per_op");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		/* Only the benchmarks named on the command line, if any. */
+		if (argc > 1) {
+			int j;
+
+			for (j = 1; j < argc; j++)
+				if (!strcmp(argv[j], benches[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		espeakup_mode = !strncmp(benches[i].name, "acsint", 6) ?
+			ESPEAKUP_MODE_ACSINT : ESPEAKUP_MODE_SPEAKUP;
+		for (n = 1024;; n *= 2) {
+			before = allocs;
+			elapsed = benches[i].run(n, &bytes);
+			if (elapsed >= benchMinMs * 1000000LL)
+				break;
+		}
+		printf("%-20s %10ld %10.1f %14.0f %13.3f\n", benches[i].name, n,
+			   (double) elapsed / n, bytes * 1e9 / elapsed,
+			   (double) (allocs - before) / n);
+		if (benches[i].run == bench_langid_line)
+			langid_accuracy();
+		fflush(stdout);
+	}
+	return 0;
+}
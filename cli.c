@@ -18,10 +18,12 @@
  */
 
 #include <getopt.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "engine.h"
 #include "espeakup.h"
 
 /* pid path */
@@ -31,11 +33,30 @@ extern char *pidPath;
 extern char *defaultVoice;
 
 /* command line options */
-const char *shortOptions = "P:V:adhv";
+const char *shortOptions = "A:D:E:F:I::L:M:P:QR:S:T:U:V:W:X::adhklo:rvw:";
 const struct option longOptions[] = {
 	{"pid-path", required_argument, NULL, 'P'},
 	{"default-voice", required_argument, NULL, 'V'},
+	{"audio-device", required_argument, NULL, 'A'},
+	{"engine", required_argument, NULL, 'E'},
+	{"auto-language", no_argument, NULL, 'l'},
+	{"voice-pool", required_argument, NULL, 'W'},
+	{"pool-memory", required_argument, NULL, 'M'},
+	{"isolate", optional_argument, NULL, 'I'},
+	{"realtime", optional_argument, NULL, 'X'},
+	{"prewarm", required_argument, NULL, 'w'},
+	{"prewarm-lock", no_argument, NULL, 'k'},
+	{"latency-file", required_argument, NULL, 'L'},
+	{"flight-file", required_argument, NULL, 'F'},
+	{"stats-socket", required_argument, NULL, 'S'},
+	{"device", required_argument, NULL, 'D'},
+	{"record", required_argument, NULL, 'R'},
+	{"render", no_argument, NULL, 'r'},
+	{"output", required_argument, NULL, 'o'},
 	{"acsint", no_argument, NULL, 'a'},
+	{"acsint-timeout", required_argument, NULL, 'T'},
+	{"drain", no_argument, NULL, 'Q'},
+	{"shutdown-timeout", required_argument, NULL, 'U'},
 	{"debug", no_argument, NULL, 'd'},
 	{"help", no_argument, NULL, 'h'},
 	{"version", no_argument, NULL, 'v'},
@@ -44,10 +65,30 @@ const struct option longOptions[] = {
 
 static void show_help()
 {
-	printf("Usage: espeakup [options]\n\n");
+	printf("Usage: espeakup [options]\n");
+	printf("       espeakup --render [options] [file...]\n\n");
 	printf("Options are as follows:\n");
 	printf("  --pid-path=path, -P path\t\tSet path for pid file.\n");
 	printf("  --default-voice=voice, -V voice\tSet default voice.\n");
+	printf("  --audio-device=pcm, -A pcm\t\tSet ALSA device to play on.\n");
+	printf("  --engine=name, -E name\t\tSynthesize with espeak or mock[:factor].\n");
+	printf("  --auto-language, -l\t\t\tSpeak each line in the voice for its language.\n");
+	printf("  --voice-pool=voices, -W voices\tKeep these voices loaded, comma-separated.\n");
+	printf("  --pool-memory=MB, -M MB\t\tMemory budget of the voice pool.\n");
+	printf("  --isolate[=ms], -I[ms]\t\tSynthesize in a child, restarted if hung for ms.\n");
+	printf("  --realtime[=prio], -X[prio]\t\tSynthesize and play at realtime priority.\n");
+	printf("  --prewarm=MB, -w MB\t\t\tKeep this much voice data in memory.\n");
+	printf("  --prewarm-lock, -k\t\t\tLock it in memory.\n");
+	printf("  --latency-file=path, -L path\t\tAppend latency statistics to path.\n");
+	printf("  --stats-socket=path, -S path\t\tServe statistics on a socket.\n");
+	printf("  --flight-file=path, -F path\t\tSet path for flight recorder dumps.\n");
+	printf("  --device=path, -D path\t\tRead from path instead of the softsynth.\n");
+	printf("  --record=path, -R path\t\tRecord what is read to path.\n");
+	printf("  --render, -r\t\t\t\tRender the files, or stdin, to WAV.\n");
+	printf("  --output=path, -o path\t\tSet WAV file (- for stdout) or directory.\n");
+	printf("  --acsint-timeout=ms, -T ms\t\tSpeak acsint text after ms idle.\n");
+	printf("  --drain, -Q\t\t\t\tSpeak what is queued before exiting.\n");
+	printf("  --shutdown-timeout=ms, -U ms\t\tExit within ms of SIGTERM.\n");
 	printf("  --debug, -d\t\t\t\tDebug mode (stay in the foreground).\n");
 	printf("  --help, -h\t\t\t\tShow this help.\n");
 	printf("  --version, -v\t\t\t\tDisplay the software version.\n");
@@ -80,9 +121,87 @@ void process_cli(int argc, char **argv)
 		case 'V':
 			defaultVoice = strdup(optarg);
 			break;
+		case 'A':
+			cp = strdup(optarg);
+			if (cp != NULL)
+				audioDevice = cp;
+			break;
+		case 'E':
+			if (select_engine(optarg) < 0)
+				exit(1);
+			break;
+		case 'l':
+			autoLanguage = 1;
+			break;
+		case 'W':
+			poolVoices = strdup(optarg);
+			break;
+		case 'M':
+			poolMemoryMb = atol(optarg);
+			break;
+		case 'I':
+			isolateSynth = 1;
+			if (optarg)
+				hangTimeoutMs = atoi(optarg);
+			if (hangTimeoutMs <= 0) {
+				fprintf(stderr, "Bad hang timeout: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'X':
+			realtimePriority = optarg ? atoi(optarg)
+				: defaultRealtimePriority;
+			if (realtimePriority < sched_get_priority_min(SCHED_FIFO)
+				|| realtimePriority > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "Bad realtime priority: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'w':
+			prewarmMemoryMb = atol(optarg);
+			break;
+		case 'k':
+			prewarmLock = 1;
+			break;
+		case 'L':
+			latencyPath = strdup(optarg);
+			break;
+		case 'S':
+			statsPath = strdup(optarg);
+			break;
+		case 'F':
+			cp = strdup(optarg);
+			if (cp != NULL)
+				flightPath = cp;
+			break;
+		case 'D':
+			softsynthPath = strdup(optarg);
+			break;
+		case 'R':
+			recordPath = strdup(optarg);
+			break;
+		case 'r':
+			render_mode = 1;
+			break;
+		case 'o':
+			renderOutput = strdup(optarg);
+			break;
 		case 'a':
 			espeakup_mode = ESPEAKUP_MODE_ACSINT;
 			break;
+		case 'T':
+			acsintFlushMs = atoi(optarg);
+			break;
+		case 'Q':
+			drainOnExit = 1;
+			break;
+		case 'U':
+			shutdownTimeoutMs = atoi(optarg);
+			if (shutdownTimeoutMs <= 0) {
+				fprintf(stderr, "Bad shutdown timeout: %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'd':
 			debug = 1;
 			break;
@@ -99,4 +218,8 @@ void process_cli(int argc, char **argv)
 			break;
 		}
 	} while (opt != -1);
+
+	/* The pool goes in front of whichever engine was selected. */
+	if (poolVoices || isolateSynth)
+		use_voice_pool();
 }
@@ -0,0 +1,46 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The clock.  Everything in the pipeline which reads the time or waits
+ * for a given time goes through here, so that the simulator (sim.c) can
+ * replace this file with a virtual clock.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "espeakup.h"
+
+/* CLOCK_MONOTONIC, in ns */
+long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleep until now_ns() reaches t. */
+void sleep_until_ns(long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
@@ -0,0 +1,104 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Engine selection, and the libespeak engine.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "engine.h"
+
+static const struct engine_t *const engines[] = {
+	&espeak_engine,
+	&mock_engine,
+};
+
+const struct engine_t *engine = &espeak_engine;
+
+/*
+ * Select an engine from a "name" or "name:options" spec.
+ * Returns -1 if there is no such engine or it does not like its options.
+ */
+int select_engine(const char *spec)
+{
+	const char *options = strchr(spec, ':');
+	size_t len = options ? (size_t) (options - spec) : strlen(spec);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		if (strlen(engines[i]->name) != len
+			|| strncmp(engines[i]->name, spec, len))
+			continue;
+		if (options && (!engines[i]->configure
+						|| engines[i]->configure(options + 1) < 0)) {
+			fprintf(stderr, "Bad options for the %s engine: %s\n",
+					engines[i]->name, options + 1);
+			return -1;
+		}
+		engine = engines[i];
+		return 0;
+	}
+	fprintf(stderr, "Unknown engine: %.*s\n", (int) len, spec);
+	return -1;
+}
+
+static int espeak_initialize(int buflength_ms)
+{
+	return espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, buflength_ms, NULL,
+							 0);
+}
+
+static espeak_ERROR espeak_synth(const void *text, size_t size,
+								 unsigned int flags)
+{
+	return espeak_Synth(text, size, 0, POS_CHARACTER, 0, flags, NULL, NULL);
+}
+
+static espeak_ERROR espeak_set_parameter(espeak_PARAMETER parameter,
+										 int value)
+{
+	return espeak_SetParameter(parameter, value, 0);
+}
+
+static const espeak_VOICE **espeak_list_voices(void)
+{
+	return espeak_ListVoices(NULL);
+}
+
+static const char *espeak_data_path(void)
+{
+	const char *path = NULL;
+
+	espeak_Info(&path);
+	return path;
+}
+
+const struct engine_t espeak_engine = {
+	.name = "espeak",
+	.initialize = espeak_initialize,
+	.set_synth_callback = espeak_SetSynthCallback,
+	.synth = espeak_synth,
+	.set_parameter = espeak_set_parameter,
+	.set_voice_by_name = espeak_SetVoiceByName,
+	.set_voice_by_properties = espeak_SetVoiceByProperties,
+	.list_voices = espeak_list_voices,
+	.cancel = espeak_Cancel,
+	.terminate = espeak_Terminate,
+	.data_path = espeak_data_path,
+};
@@ -0,0 +1,57 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include <stddef.h>
+
+#include <espeak/speak_lib.h>
+
+/*
+ * A synthesis engine.  espeak.c only talks to the engine through this,
+ * in espeak's own terms: the engine synthesizes synchronously, handing
+ * its PCM and events to the callback, which may return 1 to abort.
+ */
+struct engine_t {
+	const char *name;
+	/* Take the options after "name:" on the command line, if any. */
+	int (*configure)(const char *options);
+	/* Returns the sample rate, or a negative value on failure. */
+	int (*initialize)(int buflength_ms);
+	void (*set_synth_callback)(t_espeak_callback *cb);
+	espeak_ERROR (*synth)(const void *text, size_t size,
+						  unsigned int flags);
+	espeak_ERROR (*set_parameter)(espeak_PARAMETER parameter, int value);
+	espeak_ERROR (*set_voice_by_name)(const char *name);
+	espeak_ERROR (*set_voice_by_properties)(espeak_VOICE *spec);
+	const espeak_VOICE **(*list_voices)(void);
+	espeak_ERROR (*cancel)(void);
+	espeak_ERROR (*terminate)(void);
+	/* The directory of the engine's data files, or NULL. */
+	const char *(*data_path)(void);
+};
+
+/* the engine in use, espeak by default */
+extern const struct engine_t *engine;
+
+extern const struct engine_t espeak_engine;
+extern const struct engine_t mock_engine;
+
+extern int select_engine(const char *spec);
+
+#endif
@@ -23,7 +23,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "engine.h"
 #include "espeakup.h"
+#include "probes.h"
 
 /* default voice settings */
 const int defaultFrequency = 5;
@@ -39,24 +41,99 @@ const int rateMultiplier = 41;
 const int rateOffset = 80;
 const int volumeMultiplier = 22;
 
+/* espeak always synthesizes at this level; the volume is a gain on top. */
+const int fixedVolume = 100;
+
+/* length of the buffers espeak hands to synth_callback, in milliseconds */
+const int synthBufferMs = 20;
+
+/*
+ * 1 once the espeak thread has initialized espeak, -1 if that failed.
+ * Protected by queue_guard.
+ */
+int espeak_ready = 0;
+static pthread_cond_t espeak_initialized = PTHREAD_COND_INITIALIZER;
+
 volatile int stop_requested = 0;
+volatile int restart_requested = 0;
 int paused_espeak = 1;
 
-static int acsint_callback(short *wav, int numsamples, espeak_EVENT * events)
+/*
+ * State of the espeak_Synth call in progress: whether it may be cut
+ * short to apply live settings, the character position of the word
+ * being played, and whether we made espeak abandon the text.
+ */
+static int synth_restartable = 0;
+static int synth_word_position = 0;
+static int synth_aborted = 0;
+
+/* timestamps of the entry being spoken */
+static long long *synth_stamps = NULL;
+
+static int synth_callback(short *wav, int numsamples, espeak_EVENT * events)
 {
 	int i;
-	for (i = 0; events[i].type !=  espeakEVENT_LIST_TERMINATED; i++) {
-		if (events[i].type == espeakEVENT_MARK) {
+
+	for (i = 0; events[i].type != espeakEVENT_LIST_TERMINATED; i++) {
+		if (events[i].type == espeakEVENT_WORD)
+			synth_word_position = events[i].text_position;
+		else if (events[i].type == espeakEVENT_MARK
+				 && espeakup_mode == ESPEAKUP_MODE_ACSINT
+				 && !render_mode) {
+			/* Written by mark_thread when the audio after it plays. */
 			int mark = atoi(events[i].id.name);
 			if ((mark < 0) || (mark > 255))
 				continue;
-			putchar(mark);
-			fflush(stdout);
+			mark_push(mark, audio_play_time());
 		}
 	}
+	if (wav && numsamples > 0) {
+		if (synth_stamps && !synth_stamps[STAMP_AUDIO])
+			synth_stamps[STAMP_AUDIO] = now_ns();
+		audio_write(wav, numsamples);
+	}
+
+	/* Returning 1 makes espeak abandon the rest of the text. */
+	if (stop_requested || (restart_requested && synth_restartable)
+		|| (!should_run && !shutdown_drain)) {
+		synth_aborted = 1;
+		return 1;
+	}
 	return 0;
 }
 
+/* Byte offset of the given (0-based) character of a UTF-8 string. */
+static int text_offset(const char *buf, int len, int chars)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((buf[i] & 0xc0) == 0x80)
+			continue;
+		if (chars-- == 0)
+			break;
+	}
+	return i;
+}
+
+/*
+ * The settings are read by the stats thread, see take_snapshot(), so
+ * they are changed with queue_guard held.
+ */
+static void store_setting(int *setting, int value)
+{
+	pthread_mutex_lock(&queue_guard);
+	*setting = value;
+	pthread_mutex_unlock(&queue_guard);
+}
+
+static void store_voice(struct synth_t *s, const char *voice)
+{
+	pthread_mutex_lock(&queue_guard);
+	snprintf(s->voice, sizeof(s->voice), "%s", voice);
+	pthread_mutex_unlock(&queue_guard);
+}
+
 static espeak_ERROR set_frequency(struct synth_t *s, int freq,
 								  enum adjust_t adj)
 {
@@ -66,9 +143,9 @@ static espeak_ERROR set_frequency(struct synth_t *s, int freq,
 		freq = -freq;
 	if (adj != ADJ_SET)
 		freq += s->frequency;
-	rc = espeak_SetParameter(espeakRANGE, freq * frequencyMultiplier, 0);
+	rc = engine->set_parameter(espeakRANGE, freq * frequencyMultiplier);
 	if (rc == EE_OK)
-		s->frequency = freq;
+		store_setting(&s->frequency, freq);
 	return rc;
 }
 
@@ -81,9 +158,9 @@ static espeak_ERROR set_pitch(struct synth_t *s, int pitch,
 		pitch = -pitch;
 	if (adj != ADJ_SET)
 		pitch += s->pitch;
-	rc = espeak_SetParameter(espeakPITCH, pitch * pitchMultiplier, 0);
+	rc = engine->set_parameter(espeakPITCH, pitch * pitchMultiplier);
 	if (rc == EE_OK)
-		s->pitch = pitch;
+		store_setting(&s->pitch, pitch);
 	return rc;
 }
 
@@ -96,9 +173,9 @@ static espeak_ERROR set_punctuation(struct synth_t *s, int punct,
 		punct = -punct;
 	if (adj != ADJ_SET)
 		punct += s->punct;
-	rc = espeak_SetParameter(espeakPUNCTUATION, punct, 0);
+	rc = engine->set_parameter(espeakPUNCTUATION, punct);
 	if (rc == EE_OK)
-		s->punct = punct;
+		store_setting(&s->punct, punct);
 	return rc;
 }
 
@@ -111,52 +188,297 @@ static espeak_ERROR set_rate(struct synth_t *s, int rate,
 		rate = -rate;
 	if (adj != ADJ_SET)
 		rate += s->rate;
-	rc = espeak_SetParameter(espeakRATE,
-							 rate * rateMultiplier + rateOffset, 0);
+	rc = engine->set_parameter(espeakRATE,
+							 rate * rateMultiplier + rateOffset);
 	if (rc == EE_OK)
-		s->rate = rate;
+		store_setting(&s->rate, rate);
 	return rc;
 }
 
+/* Switch to a voice of the index, timing the switch. */
+static espeak_ERROR switch_voice(struct synth_t *s, int n)
+{
+	const struct voice_t *v = get_voice(n);
+	espeak_ERROR rc;
+	espeak_VOICE voice_select;
+	long long start, ns;
+
+	if (!v)
+		return EE_NOT_FOUND;
+	start = now_ns();
+	rc = engine->set_voice_by_name(v->name);
+	if (rc != EE_OK) {
+		memset(&voice_select, 0, sizeof(voice_select));
+		voice_select.languages = v->language;
+		rc = engine->set_voice_by_properties(&voice_select);
+	}
+	if (rc != EE_OK)
+		return rc;
+	ns = now_ns() - start;
+	PROBE2(voice_switch, n, ns);
+	pthread_mutex_lock(&queue_guard);
+	snprintf(s->voice, sizeof(s->voice), "%s", v->name);
+	stats.voice_switches++;
+	stats.voice_switch_ns += ns;
+	if (ns > stats.voice_switch_max_ns)
+		stats.voice_switch_max_ns = ns;
+	pthread_mutex_unlock(&queue_guard);
+	return EE_OK;
+}
+
+/*
+ * Select a voice by name, identifier or language.  Names which are not
+ * in the index, like espeak's "en+f3" variants, are handed to the
+ * engine as they are.
+ */
 static espeak_ERROR set_voice(struct synth_t *s, char *voice)
 {
 	espeak_ERROR rc;
 	espeak_VOICE voice_select;
+	int n = find_voice(voice);
 
-	rc = espeak_SetVoiceByName(voice);
+	if (n >= 0)
+		return switch_voice(s, n);
+	rc = engine->set_voice_by_name(voice);
 	if (rc != EE_OK)
 	{
 		memset(&voice_select, 0, sizeof(voice_select));
 		voice_select.languages = voice;
-		rc = espeak_SetVoiceByProperties(&voice_select);
+		rc = engine->set_voice_by_properties(&voice_select);
 	}
 	if (rc == EE_OK)
-		strcpy(s->voice, voice);
+		store_voice(s, voice);
 	return rc;
 }
 
-static espeak_ERROR set_volume(struct synth_t *s, int vol,
-							   enum adjust_t adj)
+/* speakup selects voices by their number in the index. */
+static espeak_ERROR set_voice_number(struct synth_t *s, int n,
+									 enum adjust_t adj)
 {
-	espeak_ERROR rc;
+	int current;
 
+	if (adj == ADJ_DEC)
+		n = -n;
+	if (adj != ADJ_SET) {
+		current = find_voice(s->voice);
+		n += current < 0 ? 0 : current;
+	}
+	if (n < 0 || n >= voice_count())
+		return EE_NOT_FOUND;
+	return switch_voice(s, n);
+}
+
+/*
+ * --auto-language: speak each line in the voice of the index for its
+ * language, going back to the voice the user chose for lines whose
+ * language cannot be told, such as the single words and letters of
+ * reviewing the screen.  Lines in the user's language stay in their
+ * voice, en-us for English say, and Latin text is only routed when the
+ * user's language is one of those it can be told apart from.
+ */
+int autoLanguage = 0;
+static int user_voice = -1;
+
+static void route_language(struct synth_t *s, const char *buf, int len)
+{
+	const char *own = user_voice >= 0 ? get_voice(user_voice)->language : "";
+	long long start = now_ns();
+	const char *language = identify_language(buf, len);
+	long long ns = now_ns() - start;
+	int n = -1;
+	int switched = 0;
+
+	if (language && language_profiled(language) && !language_profiled(own))
+		language = NULL;
+	if (language && !language_matches(own, language))
+		n = find_voice(language);
+	if (n < 0)
+		n = user_voice;
+	if (n >= 0 && n != find_voice(s->voice))
+		switched = switch_voice(s, n) == EE_OK;
+	pthread_mutex_lock(&queue_guard);
+	stats.langid_lines++;
+	stats.langid_ns += ns;
+	if (ns > stats.langid_max_ns)
+		stats.langid_max_ns = ns;
+	if (!language)
+		stats.langid_undetermined++;
+	if (switched)
+		stats.langid_switches++;
+	pthread_mutex_unlock(&queue_guard);
+}
+
+/*
+ * The volume does not go through espeak, but to the gain stage of the
+ * audio output, so it is called straight from the softsynth thread and
+ * takes effect on the audio which is already playing.
+ */
+espeak_ERROR set_volume(struct synth_t *s, int vol, enum adjust_t adj)
+{
 	if (adj == ADJ_DEC)
 		vol = -vol;
 	if (adj != ADJ_SET)
 		vol += s->volume;
-	rc = espeak_SetParameter(espeakVOLUME, (vol + 1) * volumeMultiplier,
-							 0);
-	if (rc == EE_OK)
-		s->volume = vol;
+	if (vol < 0)
+		vol = 0;
+	audio_set_gain((vol + 1) * volumeMultiplier, fixedVolume);
+	store_setting(&s->volume, vol);
 
-	return rc;
+	return EE_OK;
 }
 
 static espeak_ERROR stop_speech(void)
 {
 	espeak_ERROR rc;
 
-	rc = espeak_Cancel();
+	rc = engine->cancel();
+	audio_drop();
+	marks_flush();
+	return rc;
+}
+
+/*
+ * Long text is handed to espeak a piece at a time, cut at sentence or
+ * clause boundaries, so that the first words are heard without espeak
+ * having to get through the whole text first.  The first piece is kept
+ * short; the later ones are sized from the rate at which espeak has been
+ * getting through text, to last about chunkTargetMs each.
+ */
+static const int firstChunkMin = 24;
+static const int firstChunkMax = 160;
+static const int chunkMin = 64;
+static const int chunkMax = 4096;
+static const int chunkTargetMs = 3000;
+
+/* measured rate of synthesis, in bytes per second */
+static int synth_bytes_per_sec = 0;
+
+/* sentence, clause and word boundaries, by how good a place to cut they are */
+static const char *const marks[] = { ".!?", ",;:", " " };
+
+/* full width punctuation, three bytes of UTF-8 each, with no space after */
+static const char *const wide_marks[] = { "。！？", "，", "" };
+
+static int is_boundary(const char *buf, int len, int i, int m)
+{
+	const char *w;
+
+	for (w = wide_marks[m]; *w; w += 3)
+		if (i >= 2 && !memcmp(buf + i - 2, w, 3))
+			return 1;
+	if (!buf[i] || !strchr(marks[m], buf[i]))
+		return 0;
+	if (buf[i] == ' ')
+		return 1;
+	/* Punctuation only ends a clause when followed by a space. */
+	return i + 1 == len || buf[i + 1] == ' ' || buf[i + 1] == '\n';
+}
+
+/*
+ * Length of the next piece of text to hand to espeak, and whether it
+ * ends a sentence.  With earliest set, the first boundary at or after
+ * min is taken, otherwise the last one at or before max.  Without one,
+ * the text is cut at max, backing up to the start of a character.
+ */
+static int next_chunk(const char *buf, int len, int min, int max,
+					  int earliest, int *sentence_end)
+{
+	int m, i;
+
+	*sentence_end = 0;
+	if (len <= max)
+		return len;
+	for (m = 0; m < 3; m++) {
+		if (earliest) {
+			for (i = min; i < max; i++)
+				if (is_boundary(buf, len, i, m))
+					break;
+		} else {
+			for (i = max - 1; i >= min; i--)
+				if (is_boundary(buf, len, i, m))
+					break;
+		}
+		if (i >= min && i < max) {
+			*sentence_end = (m == 0);
+			return i + 1;
+		}
+	}
+	for (i = max; i > 1 && (buf[i] & 0xc0) == 0x80; i--)
+		;
+	return i;
+}
+
+static espeak_ERROR speak_plain(struct synth_t *s, int synth_mode)
+{
+	espeak_ERROR rc = EE_OK;
+	long long start;
+	int first = 1;
+	int n, max, sentence_end, skip;
+	long ms;
+	char saved;
+
+	/* Plain text can be resumed from a word for live settings. */
+	synth_restartable = 1;
+	while (s->len > 0) {
+		if (first) {
+			n = next_chunk(s->buf, s->len, firstChunkMin, firstChunkMax,
+						   1, &sentence_end);
+		} else {
+			max = 4 * chunkMin;
+			if (synth_bytes_per_sec)
+				max = synth_bytes_per_sec * chunkTargetMs / 1000;
+			if (max < chunkMin)
+				max = chunkMin;
+			if (max > chunkMax)
+				max = chunkMax;
+			n = next_chunk(s->buf, s->len, chunkMin / 2, max, 0,
+						   &sentence_end);
+		}
+		first = 0;
+
+		/*
+		 * espeak reads up to the terminating 0.  A sentence which ends
+		 * a piece keeps the pause it would have had inside the text;
+		 * otherwise no pause is added, so that the pieces run on.
+		 */
+		saved = s->buf[n];
+		s->buf[n] = 0;
+		synth_word_position = 0;
+		synth_aborted = 0;
+		start = now_ns();
+		rc = engine->synth(s->buf, n + 1,
+						   synth_mode | (sentence_end ? espeakENDPAUSE : 0));
+		s->buf[n] = saved;
+		if (rc != EE_OK)
+			break;
+
+		if (synth_aborted) {
+			if (stop_requested) {
+				s->len = 0;
+				break;
+			}
+			/* Leave the rest of the text, from the word being
+			 * played, for the caller to speak again. */
+			skip = 0;
+			if (synth_word_position > 0)
+				skip = text_offset(s->buf, n, synth_word_position - 1);
+			s->buf += skip;
+			s->len -= skip;
+			break;
+		}
+
+		ms = (now_ns() - start) / 1000000;
+		if (ms >= 50) {
+			if (synth_bytes_per_sec)
+				synth_bytes_per_sec = (3 * synth_bytes_per_sec
+									   + n * 1000 / ms) / 4;
+			else
+				synth_bytes_per_sec = n * 1000 / ms;
+		}
+		s->buf += n;
+		s->len -= n;
+	}
+	synth_restartable = 0;
 	return rc;
 }
 
@@ -181,16 +503,16 @@ static espeak_ERROR speak_text(struct synth_t *s)
 		if (n == -1) {
 			/* D'oh.  Not much to do on allocation failure.
 			 * Perhaps espeak will happen to say the character */
-			rc = espeak_Synth(s->buf, s->len + 1, 0, POS_CHARACTER,
-					  0, synth_mode, NULL, NULL);
+			rc = engine->synth(s->buf, s->len + 1, synth_mode);
 		} else {
-			rc = espeak_Synth(buf, n + 1, 0, POS_CHARACTER, 0,
-					  espeakSSML, NULL, NULL);
+			rc = engine->synth(buf, n + 1, espeakSSML);
 			free(buf);
 		}
+	} else if (!(synth_mode & espeakSSML)) {
+		return speak_plain(s, synth_mode);
 	} else
-		rc = espeak_Synth(s->buf, s->len + 1, 0, POS_CHARACTER, 0,
-				  synth_mode, NULL, NULL);
+		rc = engine->synth(s->buf, s->len + 1, synth_mode);
+	s->len = 0;
 	return rc;
 }
 
@@ -202,56 +524,82 @@ static void free_espeak_entry(struct espeak_entry_t *entry)
 	free(entry);
 }
 
-static void synth_queue_clear()
+void synth_queue_clear(void)
 {
 	struct espeak_entry_t *current;
 
 	while (queue_peek(synth_queue)) {
 		current = (struct espeak_entry_t *) queue_remove(synth_queue);
+		stats_entry_removed(current);
 		free_espeak_entry(current);
 	}
 }
 
-static void reinitialize_espeak(struct synth_t *s)
+/*
+ * Apply the settings waiting in live_queue.
+ * Called with queue_guard held, which is dropped while applying them.
+ */
+static void apply_live_settings(struct synth_t *s)
 {
-	int rate;
-
-	/* Re-initialize espeak */
-	rate = espeak_Initialize(AUDIO_OUTPUT_PLAYBACK, 0, NULL, 0);
-	if (rate < 0) {
-		fprintf(stderr, "Unable to initialize espeak.\n");
-		return;
+	struct espeak_entry_t *entry;
+
+	while ((entry = queue_remove(live_queue))) {
+		pthread_mutex_unlock(&queue_guard);
+		switch (entry->cmd) {
+		case CMD_SET_PITCH:
+			set_pitch(s, entry->value, entry->adjust);
+			break;
+		case CMD_SET_RATE:
+			set_rate(s, entry->value, entry->adjust);
+			break;
+		default:
+			break;
+		}
+		free_espeak_entry(entry);
+		pthread_mutex_lock(&queue_guard);
 	}
+	restart_requested = 0;
+}
 
-	/* We need a callback in acsint mode, but not in speakup mode. */
-	if (espeakup_mode == ESPEAKUP_MODE_ACSINT)
-		espeak_SetSynthCallback(acsint_callback);
-
-	/* Set parameters again */
-	espeak_SetVoiceByName(s->voice);
-	espeak_SetParameter(espeakRANGE, s->frequency * frequencyMultiplier, 0);
-	espeak_SetParameter(espeakPITCH, s->pitch * pitchMultiplier, 0);
-	espeak_SetParameter(espeakRATE, s->rate * rateMultiplier + rateOffset, 0);
-	espeak_SetParameter(espeakVOLUME, (s->volume + 1) * volumeMultiplier, 0);
-	espeak_SetParameter(espeakCAPITALS, 0, 0);
+/*
+ * espeak stays initialized while paused, with its voice loaded; only the
+ * audio device is released.  Resuming just reopens the device, which
+ * happens in the background while we start synthesizing.
+ */
+static void resume_espeak(void)
+{
+	PROBE(resume);
+	recorder_log(EV_RESUME, 0, 0);
+	audio_resume();
+	prewarm_resume();
 	paused_espeak = 0;
-	return;
 }
 
 static void queue_process_entry(struct synth_t *s)
 {
-	espeak_ERROR error;
+	espeak_ERROR error = EE_OK;
 	static struct espeak_entry_t *current = NULL;
+	/* how much voice data was in memory for a first utterance, or -1 */
+	static int first_resident = -1;
+	int cold;
 
 	if (current != queue_peek(synth_queue)) {
 		if (current)
 			free_espeak_entry(current);
 		current = (struct espeak_entry_t *) queue_remove(synth_queue);
+		current->stamp[STAMP_DEQUEUE] = now_ns();
+		stats_entry_removed(current);
+		PROBE3(dequeue, current->cmd,
+			   current->cmd == CMD_SPEAK_TEXT ? current->len : 0,
+			   current->stamp[STAMP_DEQUEUE] - current->stamp[STAMP_ENQUEUE]);
+		recorder_log(EV_DEQUEUE, current->cmd,
+					 (current->stamp[STAMP_DEQUEUE]
+					  - current->stamp[STAMP_ENQUEUE]) / 1000);
 	}
 	pthread_mutex_unlock(&queue_guard);
 
 	if (current->cmd != CMD_PAUSE && paused_espeak) {
-		reinitialize_espeak(s);
+		resume_espeak();
 	}
 
 	switch (current->cmd) {
@@ -268,20 +616,47 @@ static void queue_process_entry(struct synth_t *s)
 		error = set_rate(s, current->value, current->adjust);
 		break;
 	case CMD_SET_VOICE:
-		error = EE_OK;
-		break;
-	case CMD_SET_VOLUME:
-		error = set_volume(s, current->value, current->adjust);
+		error = set_voice_number(s, current->value, current->adjust);
+		if (error == EE_OK)
+			user_voice = find_voice(s->voice);
 		break;
 	case CMD_SPEAK_TEXT:
+		if (!current->stamp[STAMP_SYNTH]) {
+			first_resident = prewarm_speech() ? prewarm_resident() : -1;
+			if (autoLanguage)
+				route_language(s, current->buf, current->len);
+		}
 		s->buf = current->buf;
 		s->len = current->len;
+		if (!current->stamp[STAMP_SYNTH])
+			current->stamp[STAMP_SYNTH] = now_ns();
+		synth_stamps = current->stamp;
+		PROBE1(synth_start, s->len);
 		error = speak_text(s);
+		/* Interrupted for live settings: apply them and go on. */
+		while (error == EE_OK && s->len > 0) {
+			/* or to exit, or for an upgrade, which the rest goes to */
+			if (!should_run && !shutdown_drain) {
+				if (upgrade_requested)
+					upgrade_keep_text(s->buf, s->len);
+				break;
+			}
+			pthread_mutex_lock(&queue_guard);
+			apply_live_settings(s);
+			pthread_mutex_unlock(&queue_guard);
+			error = speak_text(s);
+		}
+		synth_stamps = NULL;
+		PROBE2(synth_end, error, stop_requested);
+		recorder_log(EV_SYNTH, error,
+					 (now_ns() - current->stamp[STAMP_SYNTH]) / 1000);
 		break;
 	case CMD_PAUSE:
 		if (!paused_espeak) {
-			espeak_Cancel();
-			espeak_Terminate();
+			PROBE(pause);
+			recorder_log(EV_PAUSE, 0, 0);
+			engine->cancel();
+			audio_close();
 			paused_espeak = 1;
 		}
 		break;
@@ -290,25 +665,63 @@ static void queue_process_entry(struct synth_t *s)
 	}
 
 	if (error == EE_OK) {
+		/* Flushed text would only skew the figures. */
+		if (!stop_requested) {
+			current->stamp[STAMP_DONE] = now_ns();
+			latency_record(current);
+		}
+		/* Cold when some of the voice data had to be read from disk. */
+		if (current->cmd == CMD_SPEAK_TEXT && first_resident >= 0
+			&& current->stamp[STAMP_AUDIO]) {
+			cold = first_resident < 100;
+			pthread_mutex_lock(&queue_guard);
+			stats.first_utterances[!cold]++;
+			stats.first_audio_ns[!cold] += current->stamp[STAMP_AUDIO]
+				- current->stamp[STAMP_DEQUEUE];
+			pthread_mutex_unlock(&queue_guard);
+			first_resident = -1;
+		}
 		free_espeak_entry(current);
 		current = NULL;
+	} else {
+		pthread_mutex_lock(&queue_guard);
+		stats.synth_errors++;
+		pthread_mutex_unlock(&queue_guard);
+		recorder_log(EV_ERROR, FLIGHT_ERR_SYNTH, error);
+		recorder_dump_on_error();
 	}
 }
 
+/*
+ * The volume is the one setting the softsynth thread applies itself, so
+ * it gets its default before the thread starts, rather than when espeak
+ * is initialized, which can be after speakup has changed it.
+ */
+void initialize_volume(struct synth_t *s)
+{
+	set_volume(s, defaultVolume, ADJ_SET);
+}
+
 int initialize_espeak(struct synth_t *s)
 {
 	int rate;
 
 	/* initialize espeak */
-	rate = espeak_Initialize(AUDIO_OUTPUT_PLAYBACK, 0, NULL, 0);
+	rate = engine->initialize(synthBufferMs);
 	if (rate < 0) {
 		fprintf(stderr, "Unable to initialize espeak.\n");
 		return -1;
 	}
-
-	/* We need a callback in acsint mode, but not in speakup mode. */
-	if (espeakup_mode == ESPEAKUP_MODE_ACSINT)
-		espeak_SetSynthCallback(acsint_callback);
+	/* A device missing at boot is tried again by audio_write. */
+	if (audio_open(rate) < 0 && render_mode) {
+		engine->terminate();
+		return -1;
+	}
+	engine->set_synth_callback(synth_callback);
+	if (load_voices() < 0) {
+		engine->terminate();
+		return -1;
+	}
 
 	/* Setup initial voice parameters */
 	if (defaultVoice && defaultVoice[0]) {
@@ -316,15 +729,50 @@ int initialize_espeak(struct synth_t *s)
 		free(defaultVoice);
 		defaultVoice = NULL;
 	}
+	/* Without a default voice, espeak speaks English. */
+	user_voice = find_voice(s->voice[0] ? s->voice : "en");
+	if (!s->voice[0] && user_voice >= 0)
+		store_voice(s, get_voice(user_voice)->name);
 	set_frequency(s, defaultFrequency, ADJ_SET);
 	set_pitch(s, defaultPitch, ADJ_SET);
 	set_rate(s, defaultRate, ADJ_SET);
-	set_volume(s, defaultVolume, ADJ_SET);
-	espeak_SetParameter(espeakCAPITALS, 0, 0);
+	engine->set_parameter(espeakVOLUME, fixedVolume);
+	engine->set_parameter(espeakCAPITALS, 0);
 	paused_espeak = 0;
 	return 0;
 }
 
+/*
+ * Speak everything in the queue, in the calling thread.  This is what
+ * --render does instead of running espeak_thread.
+ */
+void speak_queue(struct synth_t *s)
+{
+	pthread_mutex_lock(&queue_guard);
+	if (queue_peek(live_queue))
+		apply_live_settings(s);
+	while (queue_peek(synth_queue)) {
+		if (queue_peek(live_queue))
+			apply_live_settings(s);
+		queue_process_entry(s);
+		pthread_mutex_lock(&queue_guard);
+	}
+	pthread_mutex_unlock(&queue_guard);
+}
+
+/* Wait for the espeak thread to initialize espeak, returning -1 if it failed. */
+int wait_for_espeak(void)
+{
+	int ready;
+
+	pthread_mutex_lock(&queue_guard);
+	while (!espeak_ready)
+		pthread_cond_wait(&espeak_initialized, &queue_guard);
+	ready = espeak_ready;
+	pthread_mutex_unlock(&queue_guard);
+	return ready < 0 ? -1 : 0;
+}
+
 /* espeak_thread is the "main" function of our secondary (queue-processing)
  * thread.
  * First, lock queue_guard, because it needs to be locked when we call
@@ -339,6 +787,12 @@ int initialize_espeak(struct synth_t *s)
  * queue, so that the main thread doesn't have to wait for us to finish
  * processing the entry.  So re-lock queue_guard after each call to
  * queue_process_entry.
+ * Settings in live_queue are applied before each entry, and the text
+ * being spoken is interrupted and resumed from the current word when
+ * restart_requested is set, so that they need not wait their turn.
+ *
+ * Before all that, espeak_thread initializes espeak, which takes a while
+ * loading the voice data, while the softsynth thread is already reading.
  *
  * The main thread can add items to the queue in exactly two situations:
  * 1. We are waiting on runner_awake, or
@@ -347,21 +801,47 @@ int initialize_espeak(struct synth_t *s)
 void *espeak_thread(void *arg)
 {
 	struct synth_t *s = (struct synth_t *) arg;
+	int rc;
 
+	/* Before the pool's processes are forked, for them to inherit it. */
+	realtime_thread(REALTIME_FIFO);
+
+	/* The softsynth thread queues what it reads in the meantime. */
+	rc = initialize_espeak(s);
+	if (rc == 0)
+		start_prewarm(s);
 	pthread_mutex_lock(&queue_guard);
-	while (should_run) {
+	stats.startup[STARTUP_ENGINE] = now_ns();
+	espeak_ready = rc < 0 ? -1 : 1;
+	pthread_cond_broadcast(&espeak_initialized);
+	if (rc < 0) {
+		pthread_mutex_unlock(&queue_guard);
+		return NULL;
+	}
 
-		while (should_run && !queue_peek(synth_queue) && !stop_requested)
+	/* When draining on exit, until the queue is empty. */
+	while (should_run || (shutdown_drain && queue_peek(synth_queue))) {
+
+		while (should_run && !queue_peek(synth_queue)
+			   && !queue_peek(live_queue) && !stop_requested)
 			pthread_cond_wait(&runner_awake, &queue_guard);
 
 		if (stop_requested) {
 			stop_speech();
 			synth_queue_clear();
 			stop_requested = 0;
+			PROBE(flush_ack);
 			pthread_cond_signal(&stop_acknowledged);
 		}
 
-		while (should_run && queue_peek(synth_queue) && !stop_requested) {
+		if (queue_peek(live_queue))
+			apply_live_settings(s);
+
+		while ((should_run || shutdown_drain) && queue_peek(synth_queue)
+			   && !stop_requested) {
+			/* Live settings jump ahead of whatever is queued. */
+			if (queue_peek(live_queue))
+				apply_live_settings(s);
 			queue_process_entry(s);
 			pthread_mutex_lock(&queue_guard);
 		}
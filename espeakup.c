@@ -17,6 +17,7 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
@@ -24,8 +25,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/file.h>
 
+#include "engine.h"
 #include "espeakup.h"
 
 /* path to our pid file */
@@ -34,6 +37,7 @@ char *pidPath = "/var/run/espeakup.pid";
 int debug = 0;
 enum espeakup_mode_t espeakup_mode = ESPEAKUP_MODE_SPEAKUP;
 struct queue_t *synth_queue = NULL;
+struct queue_t *live_queue = NULL;
 
 int self_pipe_fds[2];
 volatile int should_run = 1;
@@ -136,21 +140,54 @@ error:
 	return -1;
 }
 
+/* Join a thread by a deadline on CLOCK_MONOTONIC, returning 0 if it ended. */
+static int join_by(pthread_t thread, long long deadline)
+{
+	long long left = deadline - now_ns();
+	struct timespec ts;
+
+	if (left < 0)
+		left = 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	left += ts.tv_nsec;
+	ts.tv_sec += left / 1000000000LL;
+	ts.tv_nsec = left % 1000000000LL;
+	return pthread_timedjoin_np(thread, NULL, &ts);
+}
+
+/* Join one of our threads by the shutdown deadline, returning 1 if it ended. */
+static int join_thread(pthread_t thread, const char *name, long long deadline)
+{
+	if (join_by(thread, deadline) == 0)
+		return 1;
+	fprintf(stderr, "The %s thread did not stop within %d ms, "
+			"exiting without it\n", name, shutdownTimeoutMs);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int fd, devnull;
+	int fd = -1, devnull;
+	int handover_fd;
+	long long deadline, phase[4];
+	int stopped, reader_stopped;
 	char ret = 0;
 	sigset_t sigset;
 	int err;
 	pthread_t signal_thread_id;
 	pthread_t espeak_thread_id;
 	pthread_t softsynth_thread_id;
+	pthread_t stats_thread_id;
+	pthread_t mark_thread_id;
 	struct synth_t s = {
 		.voice = "",
 	};
+
+	stats.startup[STARTUP_BEGIN] = now_ns();
 	synth_queue = new_queue();
+	live_queue = new_queue();
 
-	if (!synth_queue) {
+	if (!synth_queue || !live_queue) {
 		fprintf(stderr, "Unable to allocate memory.\n");
 		return 2;
 	}
@@ -164,7 +201,19 @@ int main(int argc, char **argv)
 	/* process command line options */
 	process_cli(argc, argv);
 
-	if (!debug && espeakup_mode == ESPEAKUP_MODE_SPEAKUP) {
+	/* Rendering to WAV needs none of the daemon's threads. */
+	if (render_mode)
+		return render_files(argc - optind, argv + optind);
+
+	/*
+	 * Started by an espeakup upgrading itself, see upgrade.c: we already
+	 * are the daemon, with its pid file, and the softsynth is open.
+	 */
+	init_upgrade();
+	handover_fd = take_handover();
+
+	if (!debug && espeakup_mode == ESPEAKUP_MODE_SPEAKUP
+		&& handover_fd < 0) {
 		fd = espeakup_start_daemon();
 
 		if (espeakup_is_running()) {
@@ -181,6 +230,15 @@ int main(int argc, char **argv)
 			close(devnull);
 	}
 
+	/*
+	 * A stats client which goes away before reading its reply is no
+	 * reason to exit: writing to it fails with EPIPE instead.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Before there are other threads, see realtime.c. */
+	setup_realtime();
+
 	/* create the signal processing thread here. */
 	err = pthread_create(&signal_thread_id, NULL, signal_thread, NULL);
 	if (err != 0) {
@@ -190,22 +248,35 @@ int main(int argc, char **argv)
 
 	/*
 	 * Set up the signal mask which will be the default for all threads.
-	 * We are handling sigint and sigterm, so block them.
+	 * We are handling sighup, sigint, sigterm, sigusr1 and sigusr2, so
+	 * block them.
 	 */
 	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
 	sigaddset(&sigset, SIGINT);
 	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGUSR2);
 	sigprocmask(SIG_BLOCK, &sigset, NULL);
 
-/* Initialize espeak */
-	if (initialize_espeak(&s) < 0) {
+	/*
+	 * espeak takes a while to initialize, loading its voice data, so the
+	 * espeak thread does it while the softsynth is opened and read, what
+	 * speakup sends in the meantime waiting in the queue.
+	 */
+	if ((handover_fd >= 0 ? adopt_softsynth(handover_fd)
+		 : open_softsynth()) < 0) {
 		ret = 2;
 		goto out;
 	}
+	stats.startup[STARTUP_SOFTSYNTH] = now_ns();
+	initialize_volume(&s);
+	restore_handover(&s);
 
-/* open the softsynth */
-	if (open_softsynth() < 0) {
-		ret = 2;
+	/* Spawn our espeak-interacting thread, which initializes espeak. */
+	err = pthread_create(&espeak_thread_id, NULL, espeak_thread, &s);
+	if (err != 0) {
+		ret = 4;
 		goto out;
 	}
 
@@ -216,24 +287,109 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	/* Spawn our espeak-interacting thread. */
-	err = pthread_create(&espeak_thread_id, NULL, espeak_thread, &s);
-	if (err != 0) {
-		ret = 4;
+	/* Write acsint's index marks from their own thread. */
+	if (espeakup_mode == ESPEAKUP_MODE_ACSINT) {
+		if (open_marks() < 0) {
+			ret = 5;
+			goto out;
+		}
+		err = pthread_create(&mark_thread_id, NULL, mark_thread, NULL);
+		if (err != 0) {
+			ret = 4;
+			goto out;
+		}
+	}
+
+	/* We are not ready until espeak can speak. */
+	if (wait_for_espeak() < 0) {
+		ret = 2;
 		goto out;
 	}
 
+	/* Serve the stats socket, if asked to. */
+	if (statsPath) {
+		if (open_stats_socket() < 0) {
+			ret = 2;
+			goto out;
+		}
+		err = pthread_create(&stats_thread_id, NULL, stats_thread, &s);
+		if (err != 0) {
+			ret = 4;
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock(&queue_guard);
+	stats.startup[STARTUP_READY] = now_ns();
+	if (handover_start)
+		stats.handover_ns = stats.startup[STARTUP_READY] - handover_start;
+	pthread_mutex_unlock(&queue_guard);
+	if (debug)
+		fprintf(stderr,
+				"Started in %.1f ms: softsynth %.1f ms, espeak %.1f ms\n",
+				(stats.startup[STARTUP_READY]
+				 - stats.startup[STARTUP_BEGIN]) / 1e6,
+				(stats.startup[STARTUP_SOFTSYNTH]
+				 - stats.startup[STARTUP_BEGIN]) / 1e6,
+				(stats.startup[STARTUP_ENGINE]
+				 - stats.startup[STARTUP_SOFTSYNTH]) / 1e6);
+	if (debug && handover_start)
+		fprintf(stderr, "Upgraded in %.1f ms\n", stats.handover_ns / 1e6);
 	if (!debug && espeakup_mode == ESPEAKUP_MODE_SPEAKUP)
 		(void)write(fd, &ret, 1);
 
-	/* wait for the threads to shut down. */
+	/*
+	 * Wait for the threads to shut down, within shutdownTimeoutMs of
+	 * being asked to.  With --drain, the espeak thread speaks what is
+	 * queued for up to three quarters of it; then what is left is
+	 * dropped, the text being spoken cut short.  A thread which has not
+	 * let go by the deadline is left behind, and what it uses is not
+	 * closed under it.
+	 */
 	pthread_join(signal_thread_id, NULL);
-	pthread_join(softsynth_thread_id, NULL);
-	pthread_join(espeak_thread_id, NULL);
+	if (!shutdown_start)
+		shutdown_start = now_ns();
+	deadline = shutdown_start + shutdownTimeoutMs * 1000000LL;
+	reader_stopped = join_thread(softsynth_thread_id, "reader", deadline);
+	if (statsPath && join_thread(stats_thread_id, "stats", deadline))
+		close_stats_socket();
+	if (espeakup_mode == ESPEAKUP_MODE_ACSINT
+		&& join_thread(mark_thread_id, "mark", deadline))
+		close_marks();
+	phase[0] = now_ns();
+
+	stopped = shutdown_drain
+		&& join_by(espeak_thread_id,
+				   deadline - shutdownTimeoutMs * 250000LL) == 0;
+	if (!stopped) {
+		pthread_mutex_lock(&queue_guard);
+		shutdown_drain = 0;
+		pthread_cond_signal(&runner_awake);
+		pthread_mutex_unlock(&queue_guard);
+		stopped = join_thread(espeak_thread_id, "espeak", deadline);
+	}
+	phase[1] = now_ns();
 
-	if (!paused_espeak)
-		espeak_Terminate();
-	close_softsynth();
+	if (stopped) {
+		stop_prewarm();
+		engine->terminate();
+	}
+	phase[2] = now_ns();
+	if (stopped)
+		audio_close();
+	phase[3] = now_ns();
+	fprintf(stderr, "Shut down in %.1f ms: threads %.1f ms, speech %.1f ms, "
+			"engine %.1f ms, audio %.1f ms\n",
+			(phase[3] - shutdown_start) / 1e6,
+			(phase[0] - shutdown_start) / 1e6, (phase[1] - phase[0]) / 1e6,
+			(phase[2] - phase[1]) / 1e6, (phase[3] - phase[2]) / 1e6);
+
+	/* Only returns if the new binary could not be run. */
+	if (upgrade_requested && reader_stopped)
+		upgrade(argv, &s);
+	if (reader_stopped)
+		close_softsynth();
+	latency_dump();
 
 out:
 	if (!debug && espeakup_mode == ESPEAKUP_MODE_SPEAKUP) {
@@ -23,6 +23,7 @@
 /* This was added for gcc 4.3 */
 #include <stddef.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #include <espeak/speak_lib.h>
 
@@ -55,12 +56,30 @@ enum adjust_t {
 	ADJ_INC,
 };
 
+/* Points in the pipeline at which entries are timestamped. */
+enum stamp_t {
+	STAMP_READ,					/* read from the softsynth */
+	STAMP_ENQUEUE,				/* added to the queue */
+	STAMP_DEQUEUE,				/* taken off the queue */
+	STAMP_SYNTH,				/* handed to espeak */
+	STAMP_AUDIO,				/* first sample handed to the device */
+	STAMP_DONE,					/* finished */
+	STAMP_COUNT,
+};
+
+enum latency_class_t {
+	LATENCY_INTERACTIVE,
+	LATENCY_BULK,
+	LATENCY_CLASSES,
+};
+
 struct espeak_entry_t {
 	enum command_t cmd;
 	enum adjust_t adjust;
 	int value;
 	char *buf;
 	int len;
+	long long stamp[STAMP_COUNT];	/* CLOCK_MONOTONIC, in ns */
 };
 
 struct synth_t {
@@ -68,25 +87,197 @@ struct synth_t {
 	int pitch;
 	int punct;
 	int rate;
-	char voice[10];
+	char voice[40];
 	int volume;
 	char *buf;
 	int len;
 };
 
+/* an entry of the voice index, see voices.c */
+struct voice_t {
+	char *name;
+	char *identifier;
+	char *language;				/* the one it is preferred for */
+};
+
+/* events kept by the flight recorder */
+enum flight_event_type_t {
+	EV_READ,
+	EV_COMMAND,
+	EV_ENQUEUE,
+	EV_DEQUEUE,
+	EV_SYNTH,
+	EV_FLUSH,
+	EV_PAUSE,
+	EV_RESUME,
+	EV_ERROR,
+	EV_COUNT,
+};
+
+/* kinds of EV_ERROR events */
+enum flight_error_t {
+	FLIGHT_ERR_READ,
+	FLIGHT_ERR_SYNTH,
+	FLIGHT_ERR_AUDIO,
+};
+
+/* Points in startup at which the time is taken, see main(). */
+enum startup_t {
+	STARTUP_BEGIN,				/* main() entered */
+	STARTUP_SOFTSYNTH,			/* softsynth opened */
+	STARTUP_ENGINE,				/* espeak initialized */
+	STARTUP_READY,				/* ready, parent told */
+	STARTUP_COUNT,
+};
+
+/* What realtime mode applies, see realtime.c. */
+enum realtime_t {
+	REALTIME_MLOCK,				/* memory locked */
+	REALTIME_PI,				/* queue_guard priority-inheriting */
+	REALTIME_FIFO,				/* espeak thread SCHED_FIFO */
+	REALTIME_NICE,				/* softsynth thread reniced */
+	REALTIME_COUNT,
+};
+
+/* figures of the pipeline, protected by queue_guard */
+struct stats_t {
+	int queue_depth;
+	long queued_bytes;
+	unsigned long flushes;
+	unsigned long read_errors;
+	unsigned long synth_errors;
+	unsigned long voice_switches;
+	long long voice_switch_ns;	/* total time spent switching */
+	long long voice_switch_max_ns;
+	unsigned long worker_restarts;	/* of the pool's workers */
+	unsigned long worker_hangs;
+	long long worker_restart_ns;
+	long long worker_restart_max_ns;
+	unsigned long langid_lines;	/* looked at by --auto-language */
+	unsigned long langid_undetermined;
+	unsigned long langid_switches;
+	long long langid_ns;
+	long long langid_max_ns;
+	long long startup[STARTUP_COUNT];	/* CLOCK_MONOTONIC, in ns */
+	long long handover_ns;		/* from SIGHUP to ready, when upgraded */
+	/* first utterances after startup, idle or a pause: cold, then warm */
+	unsigned long first_utterances[2];
+	long long first_audio_ns[2];	/* total time to their first audio */
+};
+
 extern struct queue_t *synth_queue;
+extern struct queue_t *live_queue;
 extern int debug;
 extern enum espeakup_mode_t espeakup_mode;
 
 extern void process_cli(int argc, char **argv);
 extern void *signal_thread(void *arg);
 extern int initialize_espeak(struct synth_t *s);
+extern void initialize_volume(struct synth_t *s);
+extern int wait_for_espeak(void);
+extern void synth_queue_clear(void);
+extern int espeak_ready;
 extern void *espeak_thread(void *arg);
+extern void speak_queue(struct synth_t *s);
+extern espeak_ERROR set_volume(struct synth_t *s, int vol, enum adjust_t adj);
+extern int audio_open(int rate);
+extern void audio_close(void);
+extern void audio_resume(void);
+extern void audio_drop(void);
+extern int audio_write(short *wav, int numsamples);
+extern void audio_set_gain(int num, int den);
+extern int load_voices(void);
+extern char *poolVoices;
+extern long poolMemoryMb;
+extern int isolateSynth;
+extern int hangTimeoutMs;
+extern void use_voice_pool(void);
+extern int find_voice(const char *name);
+extern const struct voice_t *get_voice(int n);
+extern int voice_count(void);
+extern const char *identify_language(const char *buf, int len);
+extern int language_matches(const char *language, const char *base);
+extern int language_profiled(const char *language);
+extern int autoLanguage;
+extern long prewarmMemoryMb;
+extern int prewarmLock;
+extern unsigned long prewarm_passes;
+extern void start_prewarm(struct synth_t *s);
+extern void stop_prewarm(void);
+extern void prewarm_resume(void);
+extern int prewarm_speech(void);
+extern int prewarm_resident(void);
+extern int realtimePriority;
+extern const int defaultRealtimePriority;
+extern int realtime_applied[REALTIME_COUNT];
+extern const char *const realtime_names[REALTIME_COUNT];
+extern void setup_realtime(void);
+extern void realtime_thread(enum realtime_t what);
+extern void map_unlocked(void);
+extern void map_locked(void);
+extern void audio_open_file(int fd);
+extern double audio_close_file(void);
+extern long long audio_play_time(void);
+extern char *audioDevice;
+extern void (*audio_tap)(const short *wav, int n, long long when,
+					  int rate);
+extern long long now_ns(void);
+extern void sleep_until_ns(long long t);
+extern enum latency_class_t latency_class(const struct espeak_entry_t *entry);
+extern void latency_record(const struct espeak_entry_t *entry);
+extern long latency_percentile(enum latency_class_t class, const char *stage,
+							   double pct);
+extern void latency_dump(void);
+extern char *latencyPath;
+extern struct stats_t stats;
+extern void stats_entry_added(const struct espeak_entry_t *entry);
+extern void stats_entry_removed(const struct espeak_entry_t *entry);
+extern int open_stats_socket(void);
+extern void close_stats_socket(void);
+extern void *stats_thread(void *arg);
+extern char *statsPath;
+extern void recorder_log(enum flight_event_type_t type, int a, long long b);
+extern void recorder_dump(const char *reason);
+extern void recorder_dump_on_error(void);
+extern char *flightPath;
+extern long audio_resume_us;
+extern void mark_push(int mark, long long when);
+extern void marks_flush(void);
+extern int open_marks(void);
+extern void close_marks(void);
+extern void *mark_thread(void *arg);
+extern unsigned long marks_written;
+extern unsigned long marks_dropped;
+extern char *softsynthPath;
+extern char *recordPath;
 extern int open_softsynth(void);
+extern int adopt_softsynth(int fd);
+extern int softsynth_fd(void);
 extern void close_softsynth(void);
 extern void *softsynth_thread(void *arg);
+extern void process_buffer(struct synth_t *s, char *buf, ssize_t length);
+extern void process_buffer_acsint(struct synth_t *s, char *buf,
+								  ssize_t length);
+extern void flush_acsint_text(void);
+extern int acsintFlushMs;
+extern int render_mode;
+extern char *renderOutput;
+extern int render_files(int count, char **paths);
+extern volatile int upgrade_requested;
+extern long long handover_start;
+extern void init_upgrade(void);
+extern int request_upgrade(void);
+extern void upgrade_keep_text(const char *buf, int len);
+extern void upgrade(char **argv, struct synth_t *s);
+extern int take_handover(void);
+extern void restore_handover(struct synth_t *s);
 extern volatile int should_run;
+extern int drainOnExit;
+extern int shutdownTimeoutMs;
+extern volatile int shutdown_drain;
+extern long long shutdown_start;
 extern volatile int stop_requested;
+extern volatile int restart_requested;
 extern int paused_espeak;
 extern int self_pipe_fds[2];
 #define PIPE_READ_FD (self_pipe_fds[0])
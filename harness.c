@@ -0,0 +1,35 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The globals espeakup.c defines, for the benchmarks, which are linked
+ * with everything but espeakup.c and have their own main().
+ */
+
+#include "espeakup.h"
+
+char *pidPath = "/var/run/espeakup.pid";
+int debug = 0;
+enum espeakup_mode_t espeakup_mode = ESPEAKUP_MODE_SPEAKUP;
+struct queue_t *synth_queue = NULL;
+struct queue_t *live_queue = NULL;
+int self_pipe_fds[2];
+volatile int should_run = 1;
+espeak_AUDIO_OUTPUT audio_mode;
+pthread_cond_t runner_awake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t stop_acknowledged = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t queue_guard = PTHREAD_MUTEX_INITIALIZER;
@@ -0,0 +1,296 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Language identification, for --auto-language.
+ *
+ * The script most of the letters of a text are written in gives its
+ * language, when only one language we know of uses it.  Latin text is
+ * told apart by counting the byte trigrams which are most common in each
+ * language, from a hash table, so that a line costs a pass over its
+ * bytes.  Text too short or too even to call is left undetermined.
+ */
+
+#include <string.h>
+
+#include "espeakup.h"
+
+/* fewer letters than this are not enough to go by */
+static const int minLetters = 12;
+
+/* trigram hits needed, and lead over the runner up, for Latin text */
+static const int minHits = 3;
+static const int minLead = 2;
+
+/* frequent trigrams, in lower case, space standing for a word boundary */
+static const struct {
+	const char *language;
+	const char *const trigrams[40];
+} latin[] = {
+	{"en", {" th", "the", "he ", "and", " an", "ing", "ng ", " to", "to ",
+			" of", "of ", "ion", " in", "is ", "ed ", "hat", "tha", "er ",
+			" wh", "you", " yo", "ith", "wit", " be", " fo", "for", "or ",
+			"ere", " no", "ory", "ch ", "ase", NULL}},
+	{"de", {"en ", "er ", "der", "die", "ie ", " di", "ein", "ich", "sch",
+			"che", "und", " un", "cht", "ch ", "ine", " ei", "gen", "den",
+			"ist", "nic", "auf", " au", "ß", "ü", "ö", "ä", "eit", "ung",
+			" ge", " be", "ber", "ter", NULL}},
+	{"fr", {"es ", "le ", " le", "les", " la", "que", " qu", "ue ", "ons",
+			"ous", " pa", "ait", "est", " et", "et ", "des", "eur", "é",
+			"è", " ce", "ce ", "ns ", "ç", " vo", " je", "je ", " ne", "ais",
+			" l ", " d ", " n ", "ez ", "ê", "ent", NULL}},
+	{"es", {"os ", " la", "la ", "que", " qu", "el ", " el", " en", "as ",
+			"los", " lo", "ió", "ado", " pa", "con", " co", "ar ", "ñ",
+			"á", "ó", " se", "ue ", "ara", "sta", "ías", "ía", "ué",
+			" y ", "ero", "ida", NULL}},
+	{"it", {" di", "di ", "che", " ch", "ell", "lla", "ato", "one", "ne ",
+			" il", "il ", "per", " pe", "del", "zio", "gli", " un", "are",
+			"nto", "no ", "ere", " e ", "ò", "à", "non", "ti ", "li ", "ri ",
+			"ni ", "ssi", "tto", "io ", "ma ", "ui ", NULL}},
+	{"pt", {"os ", "que", " qu", "ão", "çã", "do ", " do", "da ", " da",
+			"nte", " co", "com", "em ", " em", "um ", " um", "ara", " pa",
+			"nã", "ã", "õ", "ê", "ém", " se", "ões", "lh", "nh", "ei ",
+			"ou ", "eja", "vel", "ar ", NULL}},
+	{"nl", {"en ", " de", "an ", "het", " he", "et ", "van", " va", "een",
+			" ee", "ij ", "aar", "oor", "ijk", " ge", "ver", "cht", "zij",
+			" zi", "dat", " da", "ie ", "nie", "jk ", "oo", "aa", "ui",
+			" wi", "ilt", NULL}},
+};
+
+#define LATIN_LANGUAGES (sizeof(latin) / sizeof(latin[0]))
+
+/*
+ * Scripts, by Unicode block, with the language they stand for.  Latin
+ * is looked into further.
+ */
+static const struct {
+	unsigned int first, last;
+	const char *language;
+} scripts[] = {
+	{0x0041, 0x024f, NULL},		/* Latin */
+	{0x0370, 0x03ff, "el"},
+	{0x0400, 0x04ff, "ru"},
+	{0x0530, 0x058f, "hy"},
+	{0x0590, 0x05ff, "he"},
+	{0x0600, 0x06ff, "ar"},
+	{0x0900, 0x097f, "hi"},
+	{0x0980, 0x09ff, "bn"},
+	{0x0b80, 0x0bff, "ta"},
+	{0x0e00, 0x0e7f, "th"},
+	{0x10a0, 0x10ff, "ka"},
+	{0x3040, 0x30ff, "ja"},
+	{0x4e00, 0x9fff, "zh"},
+	{0xac00, 0xd7af, "ko"},
+};
+
+#define SCRIPTS (sizeof(scripts) / sizeof(scripts[0]))
+
+/*
+ * The trigrams, keyed by their bytes, with the languages having them as
+ * a bit mask.  Two byte entries, like "é", match whatever follows them.
+ */
+#define TRIGRAM_TABLE 1024
+
+static struct {
+	unsigned int key;			/* 0 when unused */
+	unsigned int key_mask;
+	unsigned int languages;
+} table[TRIGRAM_TABLE];
+static int table_ready = 0;
+
+static unsigned int slot_of(unsigned int key)
+{
+	return (key * 2654435761u) >> 22;
+}
+
+static void add_trigram(const char *t, int language)
+{
+	unsigned int key = 0, key_mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < 3 && t[i]; i++) {
+		key |= (unsigned char) t[i] << (16 - 8 * i);
+		key_mask |= 0xff << (16 - 8 * i);
+	}
+	for (i = slot_of(key); table[i].key; i = (i + 1) % TRIGRAM_TABLE)
+		if (table[i].key == key && table[i].key_mask == key_mask)
+			break;
+	table[i].key = key;
+	table[i].key_mask = key_mask;
+	table[i].languages |= 1 << language;
+}
+
+static void build_table(void)
+{
+	unsigned int l, t;
+
+	for (l = 0; l < LATIN_LANGUAGES; l++)
+		for (t = 0; latin[l].trigrams[t]; t++)
+			add_trigram(latin[l].trigrams[t], l);
+	table_ready = 1;
+}
+
+static unsigned int lookup(unsigned int key, unsigned int key_mask)
+{
+	unsigned int i;
+
+	for (i = slot_of(key); table[i].key; i = (i + 1) % TRIGRAM_TABLE)
+		if (table[i].key == key && table[i].key_mask == key_mask)
+			return table[i].languages;
+	return 0;
+}
+
+static unsigned char lower(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + 'a' - 'A';
+	if (c < 0x80 && !(c >= 'a' && c <= 'z'))
+		return ' ';
+	return c;
+}
+
+/* Score Latin text against the trigrams of each language. */
+static const char *identify_latin(const char *buf, int len)
+{
+	int hits[LATIN_LANGUAGES];
+	unsigned int key, languages;
+	unsigned char prev = ' ', c;
+	int i, l, best = -1, second = -1;
+
+	memset(hits, 0, sizeof(hits));
+	key = ' ';
+	for (i = 0; i <= len; i++) {
+		c = i < len ? lower(buf[i]) : ' ';
+		if (c == ' ' && prev == ' ')
+			continue;
+		prev = c;
+		key = ((key << 8) | c) & 0xffffff;
+		languages = lookup(key, 0xffffff);
+		/* the two byte entries, like "ij", or the UTF-8 letters */
+		languages |= lookup(key & 0xffff00, 0xffff00);
+		for (l = 0; languages; l++, languages >>= 1)
+			hits[l] += languages & 1;
+	}
+	for (l = 0; l < (int) LATIN_LANGUAGES; l++) {
+		if (best < 0 || hits[l] > hits[best]) {
+			second = best;
+			best = l;
+		} else if (second < 0 || hits[l] > hits[second])
+			second = l;
+	}
+	if (hits[best] < minHits || hits[best] - hits[second] < minLead)
+		return NULL;
+	return latin[best].language;
+}
+
+/* Whether language is base, or a variant of it, like en-us of en. */
+int language_matches(const char *language, const char *base)
+{
+	size_t n = strlen(base);
+
+	return !strncmp(language, base, n)
+		&& (language[n] == 0 || language[n] == '-');
+}
+
+/*
+ * Whether Latin text in language is told apart by the trigrams.  Text
+ * in other languages written in Latin letters, Czech or Swedish say,
+ * can score as one of those which are.
+ */
+int language_profiled(const char *language)
+{
+	unsigned int l;
+
+	for (l = 0; l < LATIN_LANGUAGES; l++)
+		if (language_matches(language, latin[l].language))
+			return 1;
+	return 0;
+}
+
+/* Decode the UTF-8 character at buf, returning its length. */
+static int decode(const unsigned char *buf, int len, unsigned int *cp)
+{
+	int n, i;
+
+	if (buf[0] < 0x80) {
+		*cp = buf[0];
+		return 1;
+	}
+	if (buf[0] >= 0xf0) {
+		n = 4;
+		*cp = buf[0] & 0x07;
+	} else if (buf[0] >= 0xe0) {
+		n = 3;
+		*cp = buf[0] & 0x0f;
+	} else if (buf[0] >= 0xc0) {
+		n = 2;
+		*cp = buf[0] & 0x1f;
+	} else {
+		*cp = 0;
+		return 1;
+	}
+	for (i = 1; i < n; i++) {
+		if (i >= len || (buf[i] & 0xc0) != 0x80) {
+			*cp = 0;
+			return i;
+		}
+		*cp = (*cp << 6) | (buf[i] & 0x3f);
+	}
+	return n;
+}
+
+/*
+ * The language of a piece of text, as an espeak language name, or NULL
+ * when it cannot be told.
+ */
+const char *identify_language(const char *buf, int len)
+{
+	int counts[SCRIPTS];
+	int letters = 0, best = 0;
+	unsigned int cp, s;
+	int i;
+
+	if (!table_ready)
+		build_table();
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < len;) {
+		i += decode((const unsigned char *) buf + i, len - i, &cp);
+		if (cp < 0x80 && !((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z'))
+			continue;
+		for (s = 0; s < SCRIPTS; s++)
+			if (cp >= scripts[s].first && cp <= scripts[s].last) {
+				counts[s]++;
+				letters++;
+				break;
+			}
+	}
+	for (s = 1; s < SCRIPTS; s++)
+		if (counts[s] > counts[best])
+			best = s;
+	/* Japanese mixes Han with kana, which Chinese does not have. */
+	if (scripts[best].first == 0x4e00 && counts[best - 1])
+		best--;
+	/* Han, kana and Hangul stand for a lot more than a letter each. */
+	if (letters < minLetters && !(scripts[best].first >= 0x3040
+								  && counts[best] >= 2))
+		return NULL;
+	if (2 * counts[best] <= letters)
+		return NULL;
+	if (scripts[best].language)
+		return scripts[best].language;
+	return identify_latin(buf, len);
+}
@@ -0,0 +1,273 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * End-to-end latency benchmark.
+ *
+ * The real pipeline is run: the softsynth and espeak threads, with
+ * espeak synthesizing, reading from a pty standing in for the softsynth
+ * and playing to the null sink, whose tap tells us when each sample
+ * would be heard.  We keep bulk text flowing, and type keys at random
+ * intervals the way speakup sends them, a flush then the character.
+ * For each key we measure
+ *   key_to_sound: from writing the key to its first non-silent sample,
+ *   flush_to_silence: from writing the key to the bulk speech stopping,
+ *     when some was playing.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "espeakup.h"
+
+/* samples quieter than this count as silence */
+static int silenceLevel = 64;
+
+/* how long to wait for a key to be heard, in milliseconds */
+static const int keyTimeoutMs = 2000;
+
+/* keys per second, and how many to type */
+static double keyRate = 2.0;
+static int keyCount = 200;
+
+static const char bulkText[] =
+	"The quick brown fox jumps over the lazy dog, while the log scrolls "
+	"by with messages about devices being found and services starting. "
+	"Each line is read out as it comes, and the user types over it to "
+	"interrupt, expecting to hear the key right away.\n";
+
+static pthread_mutex_t tap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tap_heard;
+
+/* the key being measured, all times in ns, protected by tap_lock */
+static long long key_at;		/* when it was written, 0 if none */
+static long long dropped_at;	/* when the bulk speech was dropped */
+static long long heard_at;		/* when the key would be heard */
+static long long sound_end;		/* when what the sink has would be done */
+
+static void tap(const short *wav, int n, long long when, int rate)
+{
+	int i;
+
+	pthread_mutex_lock(&tap_lock);
+	if (!n) {
+		if (key_at && !dropped_at)
+			dropped_at = when;
+		sound_end = when;
+		pthread_mutex_unlock(&tap_lock);
+		return;
+	}
+	sound_end = when + n * 1000000000LL / rate;
+	/* Once the bulk speech has been dropped, what comes is the key. */
+	if (key_at && dropped_at && !heard_at) {
+		for (i = 0; i < n; i++)
+			if (abs(wav[i]) > silenceLevel)
+				break;
+		if (i < n) {
+			heard_at = when + i * 1000000000LL / rate;
+			pthread_cond_signal(&tap_heard);
+		}
+	}
+	pthread_mutex_unlock(&tap_lock);
+}
+
+static int open_pty(int *slave_fd)
+{
+	struct termios tio;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("Unable to set up a pty");
+		return -1;
+	}
+	softsynthPath = strdup(ptsname(master));
+	*slave_fd = open(softsynthPath, O_RDWR | O_NOCTTY);
+	if (*slave_fd < 0 || tcgetattr(*slave_fd, &tio) < 0) {
+		perror("Unable to open the pty");
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(*slave_fd, TCSANOW, &tio);
+	return master;
+}
+
+static void sleep_ns(long long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	nanosleep(&ts, NULL);
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, long long *v, int n)
+{
+	qsort(v, n, sizeof(*v), compare_ll);
+	printf("%-18s %6d", name, n);
+	if (n)
+		printf(" %9lld %9lld %9lld %9lld\n", v[n / 2] / 1000,
+			   v[(int) (n * 0.99)] / 1000, v[(int) (n * 0.999)] / 1000,
+			   v[n - 1] / 1000);
+	else
+		printf(" %9s %9s %9s %9s\n", "-", "-", "-", "-");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: espeakup-latbench [-r keys_per_sec] [-n keys] "
+			"[-s silence_level] [-e engine]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct synth_t s = {
+		.voice = "",
+	};
+	pthread_t softsynth_thread_id, espeak_thread_id;
+	long long *to_sound, *to_silence;
+	int n_sound = 0, n_silence = 0, missed = 0;
+	int master, slave, opt, i;
+	long long mean, deadline;
+	struct timespec ts;
+	pthread_condattr_t attr;
+	char key[2];
+
+	while ((opt = getopt(argc, argv, "e:n:r:s:")) != -1) {
+		switch (opt) {
+		case 'e':
+			if (select_engine(optarg) < 0)
+				return 2;
+			break;
+		case 'n':
+			keyCount = atoi(optarg);
+			break;
+		case 'r':
+			keyRate = atof(optarg);
+			break;
+		case 's':
+			silenceLevel = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (keyCount <= 0 || keyRate <= 0)
+		usage();
+	/* The deadlines are on CLOCK_MONOTONIC, like now_ns(). */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tap_heard, &attr);
+	to_sound = calloc(keyCount, sizeof(long long));
+	to_silence = calloc(keyCount, sizeof(long long));
+
+	synth_queue = new_queue();
+	live_queue = new_queue();
+	if (pipe(self_pipe_fds) < 0) {
+		perror("Unable to create pipe");
+		return 5;
+	}
+	audioDevice = "null";
+	audio_tap = tap;
+	master = open_pty(&slave);
+	if (master < 0 || open_softsynth() < 0)
+		return 2;
+	initialize_volume(&s);
+	if (pthread_create(&softsynth_thread_id, NULL, softsynth_thread, &s)
+		|| pthread_create(&espeak_thread_id, NULL, espeak_thread, &s)) {
+		perror("Unable to start the pipeline");
+		return 4;
+	}
+	if (wait_for_espeak() < 0)
+		return 2;
+
+	srand(getpid());
+	mean = 1000000000LL / keyRate;
+	for (i = 0; i < keyCount; i++) {
+		if (write(master, bulkText, strlen(bulkText)) < 0)
+			break;
+		/* Uniformly within half the mean either side. */
+		sleep_ns(mean / 2 + (long long) ((double) rand() / RAND_MAX * mean));
+
+		key[0] = 0x18;
+		key[1] = 'a' + i % 26;
+		pthread_mutex_lock(&tap_lock);
+		key_at = now_ns();
+		dropped_at = heard_at = 0;
+		if (sound_end <= key_at)
+			/* Nothing to interrupt, the key comes after any drop. */
+			dropped_at = key_at;
+		pthread_mutex_unlock(&tap_lock);
+		if (write(master, key, sizeof(key)) < 0)
+			break;
+
+		deadline = now_ns() + keyTimeoutMs * 1000000LL;
+		ts.tv_sec = deadline / 1000000000LL;
+		ts.tv_nsec = deadline % 1000000000LL;
+		pthread_mutex_lock(&tap_lock);
+		while (!heard_at)
+			if (pthread_cond_timedwait(&tap_heard, &tap_lock, &ts))
+				break;
+		if (heard_at)
+			to_sound[n_sound++] = heard_at - key_at;
+		else
+			missed++;
+		if (dropped_at > key_at)
+			to_silence[n_silence++] = dropped_at - key_at;
+		key_at = 0;
+		pthread_mutex_unlock(&tap_lock);
+	}
+
+	pthread_mutex_lock(&queue_guard);
+	should_run = 0;
+	pthread_cond_broadcast(&runner_awake);
+	pthread_mutex_unlock(&queue_guard);
+	if (write(PIPE_WRITE_FD, "s", 1) < 0)
+		perror("Unable to stop the reader");
+	pthread_join(softsynth_thread_id, NULL);
+	pthread_join(espeak_thread_id, NULL);
+	engine->terminate();
+	audio_close();
+	close_softsynth();
+
+	printf("# espeakup-latbench, %d keys at %g per second, microseconds\n",
+		   keyCount, keyRate);
+	printf("%-18s %6s %9s %9s %9s %9s\n", "# measure", "count", "p50",
+		   "p99", "p99.9", "max");
+	report("key_to_sound", to_sound, n_sound);
+	report("flush_to_silence", to_silence, n_silence);
+	if (missed)
+		printf("# %d keys were not heard within %d ms\n", missed,
+			   keyTimeoutMs);
+	return 0;
+}
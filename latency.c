@@ -0,0 +1,218 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Latency histograms.
+ *
+ * Every text entry is stamped as it goes through the pipeline (see enum
+ * stamp_t), and when it is done the time spent in each stage is added
+ * to a histogram.  Entries which are short enough to be key echo are
+ * accounted separately from bulk text.
+ *
+ * The histograms are log-linear, like HDR histograms: values are in
+ * microseconds, and each power of two is split into 16 buckets, which
+ * keeps the error under 7% over the whole range.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "espeakup.h"
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_BITS 40
+#define NUM_BUCKETS ((MAX_BITS - SUB_BITS + 2) * SUB_BUCKETS)
+
+/* entries up to this many bytes are counted as interactive */
+static const int interactiveMaxLen = 16;
+
+struct histogram_t {
+	unsigned long counts[NUM_BUCKETS];
+	unsigned long total;
+	unsigned long long sum;
+	unsigned long max;
+};
+
+static const struct {
+	const char *name;
+	enum stamp_t from;
+	enum stamp_t to;
+} stages[] = {
+	{"parse", STAMP_READ, STAMP_ENQUEUE},
+	{"queue", STAMP_ENQUEUE, STAMP_DEQUEUE},
+	{"dispatch", STAMP_DEQUEUE, STAMP_SYNTH},
+	{"synth", STAMP_SYNTH, STAMP_AUDIO},
+	{"play", STAMP_AUDIO, STAMP_DONE},
+	{"first_audio", STAMP_READ, STAMP_AUDIO},
+	{"total", STAMP_READ, STAMP_DONE},
+};
+
+#define NUM_STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static const char *const classNames[LATENCY_CLASSES] = {
+	"interactive",
+	"bulk",
+};
+
+static struct histogram_t histograms[LATENCY_CLASSES][NUM_STAGES];
+
+/* where to dump the histograms, stderr when NULL */
+char *latencyPath = NULL;
+
+static int bucket_index(unsigned long v)
+{
+	int msb;
+
+	if (v < SUB_BUCKETS)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb > MAX_BITS)
+		return NUM_BUCKETS - 1;
+	return (msb - SUB_BITS + 1) * SUB_BUCKETS
+		+ ((v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Highest value which falls in a bucket. */
+static unsigned long bucket_value(int idx)
+{
+	int msb;
+	unsigned long lower;
+
+	if (idx < SUB_BUCKETS)
+		return idx;
+	msb = idx / SUB_BUCKETS + SUB_BITS - 1;
+	lower = (1UL << msb)
+		| ((unsigned long) (idx % SUB_BUCKETS) << (msb - SUB_BITS));
+	return lower + (1UL << (msb - SUB_BITS)) - 1;
+}
+
+static void histogram_add(struct histogram_t *h, unsigned long v)
+{
+	__atomic_fetch_add(&h->counts[bucket_index(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+	if (v > h->max)
+		h->max = v;
+}
+
+static unsigned long histogram_percentile(const struct histogram_t *h,
+										  double pct)
+{
+	unsigned long seen = 0;
+	unsigned long wanted;
+	int i;
+
+	if (!h->total)
+		return 0;
+	wanted = h->total * pct / 100.0;
+	if (wanted >= h->total)
+		wanted = h->total - 1;
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > wanted)
+			break;
+	}
+	if (i == NUM_BUCKETS)
+		return h->max;
+	return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+}
+
+enum latency_class_t latency_class(const struct espeak_entry_t *entry)
+{
+	return entry->len <= interactiveMaxLen ? LATENCY_INTERACTIVE :
+		LATENCY_BULK;
+}
+
+/*
+ * Account for an entry which has gone all the way through.  Stages for
+ * which a stamp is missing, because the entry was flushed or never made
+ * a sound, are left out.
+ */
+void latency_record(const struct espeak_entry_t *entry)
+{
+	enum latency_class_t class;
+	long long from, to;
+	unsigned int i;
+
+	if (entry->cmd != CMD_SPEAK_TEXT)
+		return;
+	class = latency_class(entry);
+	for (i = 0; i < NUM_STAGES; i++) {
+		from = entry->stamp[stages[i].from];
+		to = entry->stamp[stages[i].to];
+		if (!from || !to || to < from)
+			continue;
+		histogram_add(&histograms[class][i], (to - from) / 1000);
+	}
+}
+
+/*
+ * Percentile of a stage, in microseconds, for reporting elsewhere.
+ * Returns -1 for an unknown stage.
+ */
+long latency_percentile(enum latency_class_t class, const char *stage,
+						double pct)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_STAGES; i++)
+		if (!strcmp(stages[i].name, stage))
+			return histogram_percentile(&histograms[class][i], pct);
+	return -1;
+}
+
+static void dump_histograms(FILE *f)
+{
+	const struct histogram_t *h;
+	unsigned int i;
+	int c;
+
+	fprintf(f, "# espeakup latency, microseconds\n");
+	fprintf(f, "%-12s %-12s %8s %8s %8s %8s %8s %8s %8s\n", "class",
+			"stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (c = 0; c < LATENCY_CLASSES; c++) {
+		for (i = 0; i < NUM_STAGES; i++) {
+			h = &histograms[c][i];
+			fprintf(f, "%-12s %-12s %8lu %8llu %8lu %8lu %8lu %8lu %8lu\n",
+					classNames[c], stages[i].name, h->total,
+					h->total ? h->sum / h->total : 0,
+					histogram_percentile(h, 50),
+					histogram_percentile(h, 90),
+					histogram_percentile(h, 99),
+					histogram_percentile(h, 99.9), h->max);
+		}
+	}
+}
+
+void latency_dump(void)
+{
+	FILE *f = stderr;
+
+	if (latencyPath) {
+		f = fopen(latencyPath, "a");
+		if (!f) {
+			perror("Unable to open the latency file");
+			return;
+		}
+	}
+	dump_histograms(f);
+	if (f != stderr)
+		fclose(f);
+	else
+		fflush(f);
+}
@@ -0,0 +1,205 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * acsint index marks.
+ *
+ * espeak reports the marks of the text it is given from the synth
+ * callback, which must not wait on an acsint client slow to read our
+ * stdout, or synthesis and the audio would stall with it.  The callback
+ * only puts each mark in a ring, with the time at which the audio after
+ * it will be heard, and mark_thread writes the marks to stdout once that
+ * time has come, as many per write() as are due.  stdout is non-blocking,
+ * and marks the ring has no room for are counted as dropped.
+ *
+ * The ring has a single producer, the espeak thread, and a single
+ * consumer, mark_thread, so it needs no lock.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "espeakup.h"
+
+#define MARK_RING_SIZE 256		/* a power of 2 */
+
+/* most marks handed to one write() */
+static const int markBatch = 64;
+
+struct mark_t {
+	long long when;
+	unsigned char mark;
+};
+
+static struct mark_t ring[MARK_RING_SIZE];
+static unsigned int ring_head;	/* only written by the producer */
+static unsigned int ring_tail;	/* only written by mark_thread */
+
+/* Marks before this one were for audio which has been dropped. */
+static unsigned int ring_flushed;
+
+/* set by mark_thread when waiting for the ring to fill */
+static int writer_idle;
+static int wake_fds[2] = { -1, -1 };
+
+unsigned long marks_written;
+unsigned long marks_dropped;
+
+/* Queue a mark, to be written when now_ns() reaches when. */
+void mark_push(int mark, long long when)
+{
+	unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	unsigned int tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == MARK_RING_SIZE) {
+		__atomic_add_fetch(&marks_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring[head % MARK_RING_SIZE].when = when;
+	ring[head % MARK_RING_SIZE].mark = mark;
+	__atomic_store_n(&ring_head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&writer_idle, 0, __ATOMIC_SEQ_CST))
+		(void)write(wake_fds[1], "m", 1);
+}
+
+/* Forget the marks queued so far, their audio having been dropped. */
+void marks_flush(void)
+{
+	__atomic_store_n(&ring_flushed,
+					 __atomic_load_n(&ring_head, __ATOMIC_RELAXED),
+					 __ATOMIC_RELEASE);
+}
+
+int open_marks(void)
+{
+	if (pipe(wake_fds) < 0) {
+		perror("Unable to create pipe");
+		return -1;
+	}
+	fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(STDOUT_FILENO, F_SETFL,
+		  fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+void close_marks(void)
+{
+	close(wake_fds[0]);
+	close(wake_fds[1]);
+}
+
+/*
+ * Move the marks which are due from the ring to buf, which holds n.
+ * Returns how many milliseconds to wait for the next one: 0 when buf is
+ * full, or -1 when the ring is empty.
+ */
+static int take_due(char *buf, int *n)
+{
+	unsigned int tail = ring_tail;
+	unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	unsigned int flushed = __atomic_load_n(&ring_flushed, __ATOMIC_ACQUIRE);
+	long long now = now_ns();
+	int timeout = -1;
+	struct mark_t *m;
+
+	while (tail != head) {
+		if ((int) (tail - flushed) < 0) {
+			tail++;
+			continue;
+		}
+		if (*n == markBatch) {
+			timeout = 0;
+			break;
+		}
+		m = &ring[tail % MARK_RING_SIZE];
+		if (m->when > now) {
+			timeout = (m->when - now + 999999) / 1000000;
+			break;
+		}
+		buf[(*n)++] = m->mark;
+		tail++;
+	}
+	__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+	return timeout;
+}
+
+/*
+ * mark_thread writes the marks to stdout, until PIPE_READ_FD becomes
+ * readable on shutdown.
+ */
+void *mark_thread(void *arg)
+{
+	char buf[markBatch];
+	char drain[64];
+	struct pollfd fds[3];
+	int n = 0;
+	int timeout;
+	ssize_t w;
+
+	for (;;) {
+		timeout = take_due(buf, &n);
+		if (n > 0) {
+			w = write(STDOUT_FILENO, buf, n);
+			if (w > 0) {
+				__atomic_add_fetch(&marks_written, w, __ATOMIC_RELAXED);
+				n -= w;
+				memmove(buf, buf + w, n);
+			} else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("Unable to write index marks");
+				__atomic_add_fetch(&marks_dropped, n, __ATOMIC_RELAXED);
+				n = 0;
+			}
+		}
+		if (timeout == 0 && n == 0)
+			continue;
+
+		if (timeout < 0 && n == 0) {
+			/* Have mark_push wake us, unless it just did something. */
+			__atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) != ring_tail) {
+				__atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+				continue;
+			}
+		}
+
+		fds[0].fd = PIPE_READ_FD;
+		fds[0].events = POLLIN;
+		fds[1].fd = wake_fds[0];
+		fds[1].events = POLLIN;
+		/* While stdout is full, the ring fills up and marks get dropped. */
+		fds[2].fd = n > 0 ? STDOUT_FILENO : -1;
+		fds[2].events = POLLOUT;
+		fds[0].revents = fds[1].revents = fds[2].revents = 0;
+		if (n > 0)
+			timeout = -1;
+		if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+			perror("Poll failed");
+			break;
+		}
+		if (fds[0].revents)
+			break;
+		if (fds[1].revents)
+			while (read(wake_fds[0], drain, sizeof(drain)) > 0);
+		__atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
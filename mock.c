@@ -0,0 +1,185 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The mock engine, --engine=mock[:factor].
+ *
+ * It says every word as a tone lasting as long as espeak would take at
+ * the current rate, with the same WORD events, and makes its PCM factor
+ * times faster than real time (as fast as it can with 0).  That makes
+ * benchmarks of our own paths independent of espeak, and lets espeakup
+ * run where no voice data is installed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "espeakup.h"
+
+static const int mockSampleRate = 22050;
+
+/* pitch and level of the tone */
+static const int toneHz = 200;
+static const int toneLevel = 8000;
+
+static double realtime_factor = 10;
+static int chunk_ms = 20;
+static int words_per_minute = 175;
+static t_espeak_callback *mock_cb;
+
+static espeak_VOICE mockVoice = {
+	.name = "mock",
+	.languages = "\x05" "en\0",
+	.identifier = "mock",
+};
+static const espeak_VOICE *mockVoices[] = { &mockVoice, NULL };
+
+static int mock_configure(const char *options)
+{
+	char *end;
+
+	realtime_factor = strtod(options, &end);
+	if (end == options || *end || realtime_factor < 0)
+		return -1;
+	return 0;
+}
+
+static int mock_initialize(int buflength_ms)
+{
+	if (buflength_ms > 0)
+		chunk_ms = buflength_ms;
+	return mockSampleRate;
+}
+
+static void mock_set_synth_callback(t_espeak_callback *cb)
+{
+	mock_cb = cb;
+}
+
+/* A triangle wave, carried on from one chunk to the next. */
+static void make_tone(short *wav, int n, unsigned long *phase)
+{
+	int period = mockSampleRate / toneHz;
+	int i, p;
+
+	for (i = 0; i < n; i++, (*phase)++) {
+		p = *phase % period;
+		if (p < period / 2)
+			wav[i] = -toneLevel + 4 * toneLevel * p / period;
+		else
+			wav[i] = 3 * toneLevel - 4 * toneLevel * p / period;
+	}
+}
+
+static espeak_ERROR mock_synth(const void *text, size_t size,
+							   unsigned int flags)
+{
+	const char *t = text;
+	int chunk = mockSampleRate * chunk_ms / 1000;
+	short *wav;
+	espeak_EVENT events[2];
+	long long start = now_ns(), made = 0;
+	unsigned long phase = 0;
+	size_t i = 0, word;
+	int chars = 0, c, chunks, tag = 0, in_word = 0;
+
+	wav = malloc(chunk * sizeof(short));
+	if (!wav)
+		return EE_INTERNAL_ERROR;
+	chunks = 60000 / words_per_minute / chunk_ms;
+	if (chunks < 1)
+		chunks = 1;
+	for (; i < size && t[i]; i++) {
+		/* Count characters, not bytes, for the WORD events. */
+		if ((t[i] & 0xc0) != 0x80)
+			chars++;
+		if ((flags & espeakSSML) && (t[i] == '<' || tag)) {
+			tag = t[i] != '>';
+			continue;
+		}
+		if (t[i] == ' ' || t[i] == '\n' || t[i] == '\t') {
+			in_word = 0;
+			continue;
+		}
+		if (in_word)
+			continue;
+		in_word = 1;
+		memset(events, 0, sizeof(events));
+		events[0].type = espeakEVENT_WORD;
+		events[0].text_position = chars;
+		for (word = i; word < size && t[word] && t[word] != ' '; word++);
+		events[0].length = word - i;
+		for (c = 0; c < chunks; c++) {
+			make_tone(wav, chunk, &phase);
+			made += chunk_ms * 1000000LL;
+			if (realtime_factor > 0)
+				sleep_until_ns(start + (long long) (made / realtime_factor));
+			if (mock_cb && mock_cb(wav, chunk, c ? events + 1 : events)) {
+				free(wav);
+				return EE_OK;
+			}
+		}
+	}
+	free(wav);
+	memset(events, 0, sizeof(events));
+	events[0].type = espeakEVENT_MSG_TERMINATED;
+	if (mock_cb)
+		mock_cb(NULL, 0, events);
+	return EE_OK;
+}
+
+static espeak_ERROR mock_set_parameter(espeak_PARAMETER parameter, int value)
+{
+	if (parameter == espeakRATE && value > 0)
+		words_per_minute = value;
+	return EE_OK;
+}
+
+static espeak_ERROR mock_set_voice_by_name(const char *name)
+{
+	return strcmp(name, mockVoice.name) ? EE_NOT_FOUND : EE_OK;
+}
+
+static espeak_ERROR mock_set_voice_by_properties(espeak_VOICE *spec)
+{
+	return EE_OK;
+}
+
+static const espeak_VOICE **mock_list_voices(void)
+{
+	return mockVoices;
+}
+
+static espeak_ERROR mock_nothing(void)
+{
+	return EE_OK;
+}
+
+const struct engine_t mock_engine = {
+	.name = "mock",
+	.configure = mock_configure,
+	.initialize = mock_initialize,
+	.set_synth_callback = mock_set_synth_callback,
+	.synth = mock_synth,
+	.set_parameter = mock_set_parameter,
+	.set_voice_by_name = mock_set_voice_by_name,
+	.set_voice_by_properties = mock_set_voice_by_properties,
+	.list_voices = mock_list_voices,
+	.cancel = mock_nothing,
+	.terminate = mock_nothing,
+};
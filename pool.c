@@ -0,0 +1,676 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The voice pool, --voice-pool=voice,voice...
+ *
+ * espeak loads a voice and its dictionary on every switch, which takes
+ * tens of milliseconds.  With a pool, the engine is initialized once,
+ * then worker processes are forked from it: a general one, which
+ * switches voices the usual way, and one for each voice of the pool,
+ * which loads it once and keeps it.  Switching to a voice of the pool
+ * only sends the following text to its worker.
+ *
+ * The pool is an engine wrapping the one selected with --engine.  Text
+ * and settings go to the workers over a socket, and the PCM and events
+ * come back in slots of memory shared with each worker, a slot being
+ * handed back once our synth callback is done with it.  Settings go to
+ * every worker, so that they all speak alike.
+ *
+ * With --pool-memory, workers are started in the order given until
+ * their proportional set size goes over the budget; the voices left
+ * out are spoken by the general worker.
+ *
+ * A worker which crashes, or goes hangTimeoutMs without answering, is
+ * killed and forked again from the initialized engine, with the settings
+ * and voice it had, and the text it was speaking is dropped.  With
+ * --isolate and no voices, the pool only has the general worker, so that
+ * espeak never runs in our own process.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "engine.h"
+#include "espeakup.h"
+#include "stringhandling.h"
+
+/* comma-separated voices to keep loaded, none when NULL */
+char *poolVoices = NULL;
+
+/* budget for the workers, in megabytes, 0 for none */
+long poolMemoryMb = 0;
+
+/* synthesize in the general worker even without voices to keep loaded */
+int isolateSynth = 0;
+
+/* time a worker has to answer before it is taken to be hung */
+int hangTimeoutMs = 1000;
+
+#define POOL_SLOTS 8
+#define SLOT_SAMPLES 4096
+#define SLOT_EVENTS 32
+#define MARK_NAME_LEN 32
+#define POOL_PARAMETERS 16
+
+struct slot_t {
+	int numsamples;
+	int nevents;
+	short wav[SLOT_SAMPLES];
+	espeak_EVENT events[SLOT_EVENTS + 1];
+	char names[SLOT_EVENTS][MARK_NAME_LEN];
+};
+
+struct worker_t {
+	char *voice;				/* NULL for the general worker */
+	pid_t pid;					/* 0 once gone */
+	int fd;
+	struct slot_t *slots;
+	long pss_kb;
+	int voice_type;				/* the general worker's last voice switch */
+	char *voice_name;
+};
+
+enum pool_msg_type_t {
+	REQ_SYNTH,					/* a = flags, text follows */
+	REQ_PARAMETER,				/* a = parameter, b = value */
+	REQ_VOICE_NAME,				/* name follows */
+	REQ_VOICE_LANGUAGE,			/* language follows */
+	REQ_ACK,					/* a = abort */
+	MSG_READY,					/* a = espeak_ERROR of loading the voice */
+	MSG_BLOCK,					/* a = slot */
+	MSG_DONE,					/* a = espeak_ERROR */
+};
+
+struct pool_msg_t {
+	int type;
+	int a;
+	int b;
+};
+
+static const struct engine_t *inner;
+static t_espeak_callback *pool_cb;
+static struct worker_t *workers;	/* the general one first */
+static int nworkers;
+static struct worker_t *current;
+
+/* the settings sent to the workers, for those restarted */
+static int parameters[POOL_PARAMETERS];
+static unsigned int parameters_set;
+
+/* in a worker: itself, and the state of its slots */
+static struct worker_t *self;
+static int in_flight, next_slot, aborted;
+
+static int send_msg(int fd, int type, int a, int b, const void *data,
+					size_t len)
+{
+	struct pool_msg_t msg = {.type = type,.a = a,.b = b };
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(msg);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = data ? 2 : 1;
+	while (sendmsg(fd, &mh, MSG_NOSIGNAL) < 0)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/* Receive a message without a payload. */
+static int recv_msg(int fd, struct pool_msg_t *msg, int flags)
+{
+	ssize_t n;
+
+	do
+		n = recv(fd, msg, sizeof(*msg), flags);
+	while (n < 0 && errno == EINTR);
+	return n == sizeof(*msg) ? 0 : -1;
+}
+
+/*
+ * Receive a message from a worker, within hangTimeoutMs.  Returns -1
+ * when it is gone, and -2 when it is hung.
+ */
+static int recv_reply(struct worker_t *w, struct pool_msg_t *msg)
+{
+	struct pollfd pfd = {.fd = w->fd,.events = POLLIN };
+	long long deadline = now_ns() + hangTimeoutMs * 1000000LL;
+	int timeout, n;
+
+	for (;;) {
+		timeout = (deadline - now_ns() + 999999) / 1000000;
+		if (timeout <= 0)
+			return -2;
+		n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n > 0)
+			return recv_msg(w->fd, msg, MSG_DONTWAIT);
+	}
+}
+
+/*
+ * Take the slots our parent is done with, waiting for them while more
+ * than max are still in its hands.
+ */
+static void collect_acks(int max)
+{
+	struct pool_msg_t msg;
+	ssize_t n;
+
+	while (in_flight > 0) {
+		n = recv(self->fd, &msg, sizeof(msg),
+				 in_flight > max ? 0 : MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		/* our parent is gone */
+		if (n != sizeof(msg))
+			_exit(1);
+		if (msg.type == REQ_ACK) {
+			in_flight--;
+			aborted |= msg.a;
+		}
+	}
+}
+
+/* The synth callback of a worker, handing the PCM and events over. */
+static int worker_callback(short *wav, int numsamples, espeak_EVENT * events)
+{
+	struct slot_t *slot;
+	int nevents = 0, e = 0, n;
+
+	while (events[nevents].type != espeakEVENT_LIST_TERMINATED)
+		nevents++;
+	if (!wav)
+		numsamples = 0;
+	do {
+		collect_acks(POOL_SLOTS - 1);
+		if (aborted)
+			return 1;
+		slot = &self->slots[next_slot];
+		n = numsamples < SLOT_SAMPLES ? numsamples : SLOT_SAMPLES;
+		if (n) {
+			memcpy(slot->wav, wav, n * sizeof(short));
+			wav += n;
+		}
+		slot->numsamples = n;
+		numsamples -= n;
+		for (slot->nevents = 0; e < nevents && slot->nevents < SLOT_EVENTS;
+			 slot->nevents++, e++) {
+			slot->events[slot->nevents] = events[e];
+			if (events[e].type == espeakEVENT_MARK && events[e].id.name)
+				snprintf(slot->names[slot->nevents], MARK_NAME_LEN, "%s",
+						 events[e].id.name);
+		}
+		if (send_msg(self->fd, MSG_BLOCK, next_slot, 0, NULL, 0) < 0)
+			_exit(1);
+		in_flight++;
+		next_slot = (next_slot + 1) % POOL_SLOTS;
+	} while (numsamples > 0 || e < nevents);
+	return 0;
+}
+
+static espeak_ERROR worker_set_voice(int type, const char *name)
+{
+	espeak_VOICE voice_select;
+
+	if (type == REQ_VOICE_NAME)
+		return inner->set_voice_by_name(name);
+	memset(&voice_select, 0, sizeof(voice_select));
+	voice_select.languages = name;
+	return inner->set_voice_by_properties(&voice_select);
+}
+
+static void worker_main(void)
+{
+	struct pool_msg_t *msg;
+	espeak_ERROR rc = EE_OK;
+	char *buf = NULL;
+	ssize_t n;
+
+	inner->set_synth_callback(worker_callback);
+	if (self->voice) {
+		rc = worker_set_voice(REQ_VOICE_NAME, self->voice);
+		if (rc != EE_OK)
+			rc = worker_set_voice(REQ_VOICE_LANGUAGE, self->voice);
+	}
+	if (send_msg(self->fd, MSG_READY, rc, 0, NULL, 0) < 0 || rc != EE_OK)
+		_exit(1);
+
+	for (;;) {
+		/* Make room for the message, the text it carries included. */
+		n = recv(self->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < (ssize_t) sizeof(*msg))
+			_exit(0);
+		free(buf);
+		buf = allocMem(n + 1);
+		if (recv(self->fd, buf, n, 0) != n)
+			_exit(1);
+		buf[n] = 0;
+		msg = (struct pool_msg_t *) buf;
+
+		switch (msg->type) {
+		case REQ_SYNTH:
+			aborted = 0;
+			rc = inner->synth(buf + sizeof(*msg), n - sizeof(*msg),
+							  msg->a);
+			collect_acks(0);
+			send_msg(self->fd, MSG_DONE, rc, 0, NULL, 0);
+			break;
+		case REQ_PARAMETER:
+			inner->set_parameter(msg->a, msg->b);
+			break;
+		case REQ_VOICE_NAME:
+		case REQ_VOICE_LANGUAGE:
+			rc = worker_set_voice(msg->type, buf + sizeof(*msg));
+			send_msg(self->fd, MSG_DONE, rc, 0, NULL, 0);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Proportional set size of a process, in kB, or 0 if unknown. */
+static long pss_kb(pid_t pid)
+{
+	char path[64], line[128];
+	long kb = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int) pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+static void stop_worker(struct worker_t *w)
+{
+	if (!w->pid)
+		return;
+	close(w->fd);
+	waitpid(w->pid, NULL, 0);
+	w->pid = 0;
+	munmap(w->slots, POOL_SLOTS * sizeof(struct slot_t));
+	if (current == w)
+		current = workers[0].pid ? &workers[0] : NULL;
+}
+
+/* Fork a worker, and wait for it to have loaded its voice. */
+static int start_worker(struct worker_t *w)
+{
+	struct pool_msg_t msg;
+	pid_t parent = getpid();
+	int fds[2];
+	int i;
+
+	w->slots = mmap(NULL, POOL_SLOTS * sizeof(struct slot_t),
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+					0);
+	if (w->slots == MAP_FAILED) {
+		perror("Unable to map the pool's memory");
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		perror("Unable to create the pool's sockets");
+		munmap(w->slots, POOL_SLOTS * sizeof(struct slot_t));
+		return -1;
+	}
+	w->pid = fork();
+	if (w->pid < 0) {
+		perror("fork");
+		w->pid = 0;
+		close(fds[0]);
+		close(fds[1]);
+		munmap(w->slots, POOL_SLOTS * sizeof(struct slot_t));
+		return -1;
+	}
+	if (w->pid == 0) {
+		/* Not to outlive us, should we exit while it is hung. */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if (getppid() != parent)
+			_exit(1);
+		for (i = 0; i < nworkers; i++)
+			if (&workers[i] != w && workers[i].pid)
+				close(workers[i].fd);
+		close(fds[0]);
+		self = w;
+		self->fd = fds[1];
+		worker_main();
+	}
+	close(fds[1]);
+	w->fd = fds[0];
+	if (recv_reply(w, &msg) < 0 || msg.type != MSG_READY
+		|| msg.a != EE_OK) {
+		fprintf(stderr, "Unable to load voice %s in the pool\n",
+				w->voice ? w->voice : "default");
+		kill(w->pid, SIGKILL);
+		stop_worker(w);
+		return -1;
+	}
+	w->pss_kb = pss_kb(w->pid);
+	return 0;
+}
+
+/* Give a restarted worker the settings and voice it had. */
+static int restore_worker(struct worker_t *w)
+{
+	struct pool_msg_t msg;
+	unsigned int i;
+
+	for (i = 0; i < POOL_PARAMETERS; i++)
+		if (parameters_set & (1u << i)
+			&& send_msg(w->fd, REQ_PARAMETER, i, parameters[i], NULL, 0) < 0)
+			return -1;
+	if (w->voice || !w->voice_name)
+		return 0;
+	if (send_msg(w->fd, w->voice_type, 0, 0, w->voice_name,
+				 strlen(w->voice_name) + 1) < 0
+		|| recv_reply(w, &msg) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * A worker crashed or hung: kill it, and fork it again.  Should that
+ * fail, its voice is spoken by the general worker from then on.
+ */
+static void worker_lost(struct worker_t *w, int hung)
+{
+	long long start = now_ns(), took;
+
+	fprintf(stderr, "The synthesis worker for %s %s, restarting it\n",
+			w->voice ? w->voice : "other voices",
+			hung ? "hung" : "was lost");
+	recorder_log(EV_ERROR, FLIGHT_ERR_SYNTH, EE_INTERNAL_ERROR);
+	if (w->pid) {
+		kill(w->pid, SIGKILL);
+		close(w->fd);
+		waitpid(w->pid, NULL, 0);
+		w->pid = 0;
+		munmap(w->slots, POOL_SLOTS * sizeof(struct slot_t));
+	}
+	if (start_worker(w) < 0 || restore_worker(w) < 0) {
+		fprintf(stderr, "Unable to restart the synthesis worker\n");
+		if (w->pid) {
+			kill(w->pid, SIGKILL);
+			stop_worker(w);
+		}
+		if (current == w)
+			current = workers[0].pid ? &workers[0] : NULL;
+	}
+	took = now_ns() - start;
+
+	pthread_mutex_lock(&queue_guard);
+	stats.worker_restarts++;
+	stats.worker_hangs += hung;
+	stats.worker_restart_ns += took;
+	if (took > stats.worker_restart_max_ns)
+		stats.worker_restart_max_ns = took;
+	pthread_mutex_unlock(&queue_guard);
+	if (debug)
+		fprintf(stderr, "Synthesis worker restarted in %.1f ms\n",
+				took / 1e6);
+}
+
+static int pool_initialize(int buflength_ms)
+{
+	long total_kb = 0;
+	char *voices, *voice, *save;
+	int rate, i;
+
+	/* The workers inherit the initialized engine. */
+	rate = inner->initialize(buflength_ms);
+	if (rate < 0)
+		return rate;
+
+	voices = strdup(poolVoices ? poolVoices : "");
+	if (!voices)
+		return -1;
+	nworkers = 1;
+	for (i = 0; voices[i]; i++)
+		if (voices[i] == ',')
+			nworkers++;
+	workers = calloc(nworkers + 1, sizeof(*workers));
+	if (!workers)
+		return -1;
+	nworkers = 1;
+	for (voice = strtok_r(voices, ",", &save); voice;
+		 voice = strtok_r(NULL, ",", &save))
+		workers[nworkers++].voice = voice;
+
+	for (i = 0; i < nworkers; i++) {
+		if (start_worker(&workers[i]) < 0) {
+			if (i == 0)
+				return -1;
+			continue;
+		}
+		total_kb += workers[i].pss_kb;
+		if (i > 0 && poolMemoryMb && total_kb > poolMemoryMb * 1024) {
+			fprintf(stderr, "Voice %s left out of the pool, "
+					"over the %ld MB budget\n", workers[i].voice,
+					poolMemoryMb);
+			total_kb -= workers[i].pss_kb;
+			stop_worker(&workers[i]);
+			break;
+		}
+		if (debug)
+			fprintf(stderr, "Voice %s loaded in the pool, %ld kB\n",
+					workers[i].voice ? workers[i].voice : "default",
+					workers[i].pss_kb);
+	}
+	current = &workers[0];
+	return rate;
+}
+
+static void pool_set_synth_callback(t_espeak_callback *cb)
+{
+	pool_cb = cb;
+}
+
+static espeak_ERROR pool_synth(const void *text, size_t size,
+							   unsigned int flags)
+{
+	struct worker_t *w;
+	struct pool_msg_t msg;
+	struct slot_t *slot;
+	int i, abort, err = -1;
+
+	/* The general worker could not be restarted last time: try again. */
+	if (!workers[0].pid)
+		worker_lost(&workers[0], 0);
+	if (!current)
+		current = workers[0].pid ? &workers[0] : NULL;
+	w = current;
+	if (!w)
+		return EE_INTERNAL_ERROR;
+	if (send_msg(w->fd, REQ_SYNTH, flags, 0, text, size) < 0)
+		goto lost;
+	for (;;) {
+		err = recv_reply(w, &msg);
+		if (err < 0)
+			goto lost;
+		if (msg.type == MSG_DONE)
+			return msg.a;
+		if (msg.type != MSG_BLOCK)
+			continue;
+		slot = &w->slots[msg.a];
+		for (i = 0; i < slot->nevents; i++)
+			if (slot->events[i].type == espeakEVENT_MARK)
+				slot->events[i].id.name = slot->names[i];
+		slot->events[slot->nevents].type = espeakEVENT_LIST_TERMINATED;
+		abort = pool_cb(slot->numsamples ? slot->wav : NULL,
+						slot->numsamples, slot->events);
+		if (send_msg(w->fd, REQ_ACK, abort, 0, NULL, 0) < 0)
+			goto lost;
+	}
+lost:
+	/* The text it choked on is not tried again. */
+	worker_lost(w, err == -2);
+	return EE_INTERNAL_ERROR;
+}
+
+static espeak_ERROR pool_set_parameter(espeak_PARAMETER parameter,
+									   int value)
+{
+	int i;
+
+	if ((unsigned int) parameter < POOL_PARAMETERS) {
+		parameters[parameter] = value;
+		parameters_set |= 1u << parameter;
+	}
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].pid
+			&& send_msg(workers[i].fd, REQ_PARAMETER, parameter, value,
+						NULL, 0) < 0)
+			worker_lost(&workers[i], 0);
+	return workers[0].pid ? EE_OK : EE_INTERNAL_ERROR;
+}
+
+/* Have the general worker switch voices. */
+static espeak_ERROR general_set_voice(int type, const char *name)
+{
+	struct worker_t *w = &workers[0];
+	struct pool_msg_t msg;
+	int err;
+
+	if (!w->pid)
+		return EE_INTERNAL_ERROR;
+	if (send_msg(w->fd, type, 0, 0, name, strlen(name) + 1) < 0)
+		err = -1;
+	else
+		err = recv_reply(w, &msg);
+	if (err < 0) {
+		worker_lost(w, err == -2);
+		return EE_INTERNAL_ERROR;
+	}
+	if (msg.a == EE_OK) {
+		current = w;
+		free(w->voice_name);
+		w->voice_type = type;
+		w->voice_name = strdup(name);
+	}
+	return msg.a;
+}
+
+/* Whether a worker of the pool has this voice. */
+static int has_voice(struct worker_t *w, const char *name)
+{
+	const struct voice_t *v;
+
+	if (!w->pid || !w->voice)
+		return 0;
+	if (!strcmp(w->voice, name))
+		return 1;
+	v = get_voice(find_voice(w->voice));
+	return v && !strcmp(v->name, name);
+}
+
+static espeak_ERROR pool_set_voice_by_name(const char *name)
+{
+	int i;
+
+	for (i = 1; i < nworkers; i++)
+		if (has_voice(&workers[i], name)) {
+			current = &workers[i];
+			return EE_OK;
+		}
+	return general_set_voice(REQ_VOICE_NAME, name);
+}
+
+static espeak_ERROR pool_set_voice_by_properties(espeak_VOICE *spec)
+{
+	if (!spec->languages)
+		return EE_NOT_FOUND;
+	return general_set_voice(REQ_VOICE_LANGUAGE, spec->languages);
+}
+
+static const espeak_VOICE **pool_list_voices(void)
+{
+	return inner->list_voices();
+}
+
+/* Synthesis is synchronous, there is never anything to cancel. */
+static espeak_ERROR pool_cancel(void)
+{
+	return EE_OK;
+}
+
+static espeak_ERROR pool_terminate(void)
+{
+	int i;
+
+	/* Nothing they hold is worth waiting for, should they be hung. */
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid)
+			kill(workers[i].pid, SIGKILL);
+		stop_worker(&workers[i]);
+	}
+	return inner->terminate();
+}
+
+static const char *pool_data_path(void)
+{
+	return inner->data_path ? inner->data_path() : NULL;
+}
+
+static const struct engine_t pool_engine = {
+	.name = "pool",
+	.initialize = pool_initialize,
+	.set_synth_callback = pool_set_synth_callback,
+	.synth = pool_synth,
+	.set_parameter = pool_set_parameter,
+	.set_voice_by_name = pool_set_voice_by_name,
+	.set_voice_by_properties = pool_set_voice_by_properties,
+	.list_voices = pool_list_voices,
+	.cancel = pool_cancel,
+	.terminate = pool_terminate,
+	.data_path = pool_data_path,
+};
+
+/* Put the pool in front of the selected engine. */
+void use_voice_pool(void)
+{
+	inner = engine;
+	engine = &pool_engine;
+}
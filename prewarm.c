@@ -0,0 +1,303 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The voice data in the page cache.
+ *
+ * The first words after boot, or after a long silence, wait on espeak
+ * reading its phoneme data, dictionary and voice file from disk.  The
+ * files of the configured voices are mapped once espeak is initialized,
+ * which costs nothing until they are read, and lets mincore() tell how
+ * much of them is in memory when speech starts, so that the first
+ * utterances can be reported as cold or warm.
+ *
+ * With --prewarm=MB, prewarm_thread reads in up to that much of them,
+ * and reads them again after a pause and every prewarmIdleSec of
+ * silence, so that the kernel keeps them.  With --prewarm-lock, they are
+ * locked in memory instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "engine.h"
+#include "espeakup.h"
+
+#define PREWARM_FILES 32
+
+/* silence after which the data is read again, and speech is first again */
+static const int prewarmIdleSec = 60;
+
+/* megabytes of data to keep warm, none by default */
+long prewarmMemoryMb = 0;
+
+/* lock them rather than read them */
+int prewarmLock = 0;
+
+static struct {
+	void *addr;
+	size_t len;
+	int warm;					/* within the budget */
+	int locked;
+} files[PREWARM_FILES];
+static int nfiles = 0;
+static long page_size;
+
+static pthread_mutex_t prewarm_guard = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prewarm_wake;
+static int prewarm_woken = 0;
+static int prewarm_stopping = 0;
+static int prewarm_running = 0;
+static pthread_t prewarm_thread_id;
+
+/* when speech last started, and whether there was a pause since */
+static long long last_speech = 0;
+static int paused_since = 0;
+
+unsigned long prewarm_passes = 0;
+
+static void map_file(const char *dir, const char *name)
+{
+	char path[4096];
+	struct stat st;
+	void *addr;
+	int fd;
+
+	if (nfiles == PREWARM_FILES)
+		return;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return;
+	files[nfiles].addr = addr;
+	files[nfiles].len = st.st_size;
+	nfiles++;
+}
+
+/* Map the voice file and dictionary of a voice of the index. */
+static void map_voice(const char *dir, const struct voice_t *v)
+{
+	char name[256];
+	size_t n;
+
+	if (!v)
+		return;
+	/* espeak keeps them in voices/, espeak-ng in lang/ */
+	snprintf(name, sizeof(name), "voices/%s", v->identifier);
+	map_file(dir, name);
+	snprintf(name, sizeof(name), "lang/%s", v->identifier);
+	map_file(dir, name);
+	/* The dictionary is named after the language, without its region. */
+	n = strcspn(v->language, "-");
+	snprintf(name, sizeof(name), "%.*s_dict", (int) n, v->language);
+	map_file(dir, name);
+}
+
+/* Read a byte of each page of the warm files, or lock them. */
+static void touch_files(void)
+{
+	volatile const char *p;
+	unsigned int sum = 0;
+	size_t off;
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		if (!files[i].warm || files[i].locked)
+			continue;
+		if (prewarmLock) {
+			if (mlock(files[i].addr, files[i].len) == 0) {
+				files[i].locked = 1;
+				continue;
+			}
+			perror("Unable to lock the voice data");
+			prewarmLock = 0;
+		}
+		madvise(files[i].addr, files[i].len, MADV_WILLNEED);
+		p = files[i].addr;
+		for (off = 0; off < files[i].len; off += page_size)
+			sum += p[off];
+	}
+	(void)sum;
+	__atomic_add_fetch(&prewarm_passes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * prewarm_thread reads the data in, then again when woken after a pause
+ * and after every prewarmIdleSec without speech.
+ */
+static void *prewarm_thread(void *arg)
+{
+	struct timespec ts;
+	long long deadline;
+
+	pthread_mutex_lock(&prewarm_guard);
+	while (!prewarm_stopping) {
+		pthread_mutex_unlock(&prewarm_guard);
+		touch_files();
+		pthread_mutex_lock(&prewarm_guard);
+		deadline = now_ns() + prewarmIdleSec * 1000000000LL;
+		while (!prewarm_stopping && !prewarm_woken) {
+			ts.tv_sec = deadline / 1000000000LL;
+			ts.tv_nsec = deadline % 1000000000LL;
+			if (pthread_cond_timedwait(&prewarm_wake, &prewarm_guard, &ts)
+				!= ETIMEDOUT)
+				continue;
+			/* Speech keeps the data warm by itself. */
+			deadline = __atomic_load_n(&last_speech, __ATOMIC_RELAXED)
+				+ prewarmIdleSec * 1000000000LL;
+			if (deadline <= now_ns())
+				break;
+		}
+		prewarm_woken = 0;
+	}
+	pthread_mutex_unlock(&prewarm_guard);
+	return NULL;
+}
+
+/*
+ * Map the data files of espeak and of the voices in use: the default
+ * one and those of the pool.  Then start prewarm_thread, if asked to.
+ */
+void start_prewarm(struct synth_t *s)
+{
+	static const char *const common[] = {
+		"phontab", "phonindex", "phondata", "intonations",
+	};
+	const char *dir = engine->data_path ? engine->data_path() : NULL;
+	pthread_condattr_t attr;
+	long budget = prewarmMemoryMb * 1024 * 1024;
+	char *list, *name, *save;
+	unsigned int i;
+	int warm = 0;
+
+	if (!dir)
+		return;
+	page_size = sysconf(_SC_PAGESIZE);
+	/* Not locked by --realtime, which would read them in whole. */
+	map_unlocked();
+	for (i = 0; i < sizeof(common) / sizeof(common[0]); i++)
+		map_file(dir, common[i]);
+	/* Without a default voice, espeak speaks English. */
+	map_voice(dir, get_voice(find_voice(s->voice[0] ? s->voice : "en")));
+	if (poolVoices && (list = strdup(poolVoices))) {
+		for (name = strtok_r(list, ",", &save); name;
+			 name = strtok_r(NULL, ",", &save))
+			map_voice(dir, get_voice(find_voice(name)));
+		free(list);
+	}
+	map_locked();
+
+	/* What does not fit in the budget is left to the kernel. */
+	for (i = 0; i < (unsigned int) nfiles; i++) {
+		if ((long) files[i].len > budget)
+			continue;
+		budget -= files[i].len;
+		files[i].warm = 1;
+		warm++;
+	}
+	if (!warm)
+		return;
+
+	/* The deadlines are on CLOCK_MONOTONIC, like now_ns(). */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&prewarm_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&prewarm_thread_id, NULL, prewarm_thread, NULL) == 0)
+		prewarm_running = 1;
+}
+
+void stop_prewarm(void)
+{
+	int i;
+
+	if (prewarm_running) {
+		pthread_mutex_lock(&prewarm_guard);
+		prewarm_stopping = 1;
+		pthread_cond_signal(&prewarm_wake);
+		pthread_mutex_unlock(&prewarm_guard);
+		pthread_join(prewarm_thread_id, NULL);
+		prewarm_running = 0;
+	}
+	for (i = 0; i < nfiles; i++)
+		munmap(files[i].addr, files[i].len);
+	nfiles = 0;
+}
+
+/* Speech resumes after a pause: the data may have been dropped since. */
+void prewarm_resume(void)
+{
+	__atomic_store_n(&paused_since, 1, __ATOMIC_RELAXED);
+	if (!prewarm_running)
+		return;
+	pthread_mutex_lock(&prewarm_guard);
+	prewarm_woken = 1;
+	pthread_cond_signal(&prewarm_wake);
+	pthread_mutex_unlock(&prewarm_guard);
+}
+
+/*
+ * Speech starts, from the espeak thread.  Returns whether it is the
+ * first since startup, a pause or prewarmIdleSec of silence.
+ */
+int prewarm_speech(void)
+{
+	long long now = now_ns();
+	long long last = __atomic_exchange_n(&last_speech, now,
+										 __ATOMIC_RELAXED);
+
+	return __atomic_exchange_n(&paused_since, 0, __ATOMIC_RELAXED)
+		|| !last || now - last >= prewarmIdleSec * 1000000000LL;
+}
+
+/* Percentage of the mapped data in memory, or -1 when none is mapped. */
+int prewarm_resident(void)
+{
+	unsigned char vec[256];
+	size_t pages = 0, resident = 0;
+	size_t off, len, n, j;
+	int i;
+
+	for (i = 0; i < nfiles; i++)
+		for (off = 0; off < files[i].len; off += n * page_size) {
+			len = files[i].len - off;
+			n = (len + page_size - 1) / page_size;
+			if (n > sizeof(vec))
+				n = sizeof(vec);
+			if (mincore((char *) files[i].addr + off,
+						len < n * page_size ? len : n * page_size, vec) < 0)
+				return -1;
+			for (j = 0; j < n; j++)
+				resident += vec[j] & 1;
+			pages += n;
+		}
+	return pages ? resident * 100 / pages : -1;
+}
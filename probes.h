@@ -0,0 +1,42 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Static tracepoints.  Building with "make SDT=1" turns these into
+ * sys/sdt.h probes in the espeakup provider, which perf and bpftrace can
+ * attach to (see espeakup.bt); a probe is a single nop until something
+ * attaches to it.  Otherwise they compile to nothing.
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(espeakup, name)
+#define PROBE1(name, a) DTRACE_PROBE1(espeakup, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(espeakup, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(espeakup, name, a, b, c)
+#else
+#define PROBE(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Realtime mode, --realtime.
+ *
+ * On a loaded machine, the espeak thread, which synthesizes and hands
+ * the audio to the device, can be kept off the CPU until the device runs
+ * dry, and the softsynth thread can fall behind on key echo.  In
+ * realtime mode the espeak thread runs SCHED_FIFO at realtimePriority,
+ * and the audio resume thread and the pool's processes it starts inherit
+ * that.  The softsynth thread gets readerNice.  Memory is locked, with
+ * the stacks faulted in, so that neither waits on a page fault, and
+ * queue_guard passes the priority of its waiters on to its holder, so
+ * that a preempted reader holding it does not hold up the espeak thread.
+ *
+ * Most of this needs CAP_SYS_NICE and CAP_IPC_LOCK, or high enough
+ * RLIMIT_RTPRIO, RLIMIT_NICE and RLIMIT_MEMLOCK.  What cannot be had is
+ * done without, and reported.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "espeakup.h"
+
+/* SCHED_FIFO priority of the espeak thread, 0 when not in realtime mode */
+int realtimePriority = 0;
+const int defaultRealtimePriority = 20;
+
+/* nice value of the softsynth thread */
+static const int readerNice = -10;
+
+/*
+ * Stacks are locked whole, so threads get smaller ones than the 8 MiB
+ * default, and this much of each is faulted in when it starts.
+ */
+static const size_t realtimeStackKb = 2048;
+static const size_t prefaultStackKb = 64;
+
+/*
+ * Memory the threads and their allocations will want locked after
+ * startup.  When RLIMIT_MEMLOCK does not leave this much, only what is
+ * mapped at startup is locked, as locking what comes later would make
+ * creating the threads fail.
+ */
+static const size_t lockHeadroomMb = 32;
+
+/* whether what is mapped after startup is locked, see map_unlocked */
+static int locked_future = 0;
+
+/* what was applied, 1 if it was, for the stats socket */
+int realtime_applied[REALTIME_COUNT];
+
+const char *const realtime_names[REALTIME_COUNT] = {
+	"mlockall", "priority_inheritance", "espeak_fifo", "reader_nice",
+};
+
+static void prefault_stack(void)
+{
+	volatile char stack[prefaultStackKb * 1024];
+
+	memset((char *) stack, 0, sizeof(stack));
+}
+
+static void report(const char *what, int err)
+{
+	if (err)
+		fprintf(stderr, "Realtime: unable to %s: %s\n", what, strerror(err));
+	else if (debug)
+		fprintf(stderr, "Realtime: %s\n", what);
+}
+
+/* Lock what is mapped and, if there is room under the limit, what will be. */
+static int lock_memory(void)
+{
+	size_t len = lockHeadroomMb * 1024 * 1024;
+	struct rlimit rl;
+	void *probe;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_MEMLOCK, &rl);
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return errno;
+	probe = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (probe != MAP_FAILED) {
+		munmap(probe, len);
+		locked_future = 1;
+		return 0;
+	}
+	munlockall();
+	report("lock memory allocated after startup", ENOMEM);
+	return mlockall(MCL_CURRENT) < 0 ? errno : 0;
+}
+
+/*
+ * Stop locking what is mapped, until map_locked(), so that files can be
+ * mapped without being read in and locked whole: prewarm.c's voice data,
+ * which it reads within its own budget and tells the residence of.
+ * What the other threads map meanwhile is not locked either.
+ */
+void map_unlocked(void)
+{
+	if (locked_future)
+		mlockall(MCL_CURRENT);
+}
+
+void map_locked(void)
+{
+	if (locked_future)
+		mlockall(MCL_FUTURE);
+}
+
+/*
+ * Lock memory and make queue_guard priority-inheriting.  Called by main()
+ * before any other thread exists, as queue_guard must not be in use.
+ */
+void setup_realtime(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_attr_t attr;
+	int err;
+
+	if (!realtimePriority)
+		return;
+
+	pthread_mutexattr_init(&mattr);
+	err = pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+	if (!err) {
+		pthread_mutex_destroy(&queue_guard);
+		err = pthread_mutex_init(&queue_guard, &mattr);
+		if (err)
+			pthread_mutex_init(&queue_guard, NULL);
+	}
+	pthread_mutexattr_destroy(&mattr);
+	report("make the queue lock priority-inheriting", err);
+	realtime_applied[REALTIME_PI] = !err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, realtimeStackKb * 1024);
+	pthread_setattr_default_np(&attr);
+	pthread_attr_destroy(&attr);
+
+	err = lock_memory();
+	report("lock memory", err);
+	realtime_applied[REALTIME_MLOCK] = !err;
+	prefault_stack();
+}
+
+/* Switch the calling thread to SCHED_FIFO, within RLIMIT_RTPRIO if need be. */
+static void set_fifo(void)
+{
+	struct sched_param param = {.sched_priority = realtimePriority };
+	struct rlimit rl;
+	char what[64];
+	int err;
+
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err == EPERM && getrlimit(RLIMIT_RTPRIO, &rl) == 0
+		&& rl.rlim_cur > 0 && rl.rlim_cur < (rlim_t) realtimePriority) {
+		param.sched_priority = rl.rlim_cur;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	}
+	snprintf(what, sizeof(what), "run the espeak thread at SCHED_FIFO %d",
+			 param.sched_priority);
+	report(what, err);
+	realtime_applied[REALTIME_FIFO] = !err;
+}
+
+/* Raise the calling thread's priority, within RLIMIT_NICE if need be. */
+static void set_nice(void)
+{
+	pid_t tid = syscall(SYS_gettid);
+	struct rlimit rl;
+	int nice = readerNice;
+	char what[64];
+	int err;
+
+	err = setpriority(PRIO_PROCESS, tid, nice) < 0 ? errno : 0;
+	/* RLIMIT_NICE allows down to 20 - its value. */
+	if (err == EACCES && getrlimit(RLIMIT_NICE, &rl) == 0
+		&& rl.rlim_cur > 20 && 20 - (int) rl.rlim_cur > nice) {
+		nice = 20 - (int) rl.rlim_cur;
+		err = setpriority(PRIO_PROCESS, tid, nice) < 0 ? errno : 0;
+	}
+	snprintf(what, sizeof(what), "run the softsynth thread at nice %d",
+			 nice);
+	report(what, err);
+	realtime_applied[REALTIME_NICE] = !err;
+}
+
+/* Called by the espeak and softsynth threads as they start. */
+void realtime_thread(enum realtime_t what)
+{
+	if (!realtimePriority)
+		return;
+	prefault_stack();
+	if (what == REALTIME_FIFO)
+		set_fifo();
+	else if (what == REALTIME_NICE)
+		set_nice();
+}
@@ -0,0 +1,38 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RECORD_H
+#define __RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Format of the captures written by --record and read by
+ * espeakup-replay: RECORD_MAGIC, then for each read() from the softsynth
+ * a record header followed by the len bytes which were read.  Numbers
+ * are in host byte order, captures are meant to be replayed on the same
+ * kind of machine.
+ */
+#define RECORD_MAGIC "espeakup-record 1\n"
+
+struct record_header_t {
+	uint64_t t_ns;				/* time since the capture started */
+	uint32_t len;
+	uint32_t pad;
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The flight recorder.
+ *
+ * Recent pipeline events are kept in a fixed-size ring, so that when
+ * speech lagged or went silent there is a timeline to look at.  Any
+ * thread may record: a slot is claimed with an atomic increment and
+ * published by storing its sequence number last, so recording takes no
+ * lock and costs about a clock read.  The ring is dumped to a file on
+ * SIGUSR2, and after espeak reports an error.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "espeakup.h"
+
+#define FLIGHT_EVENTS 4096
+
+/* don't dump more often than this on errors, in seconds */
+static const int errorDumpInterval = 10;
+
+struct flight_event_t {
+	unsigned long seq;			/* sequence number + 1, 0 while written */
+	long long t;
+	int type;
+	int a;
+	long long b;
+};
+
+static const char *const eventNames[] = {
+	[EV_READ] = "read",
+	[EV_COMMAND] = "command",
+	[EV_ENQUEUE] = "enqueue",
+	[EV_DEQUEUE] = "dequeue",
+	[EV_SYNTH] = "synth",
+	[EV_FLUSH] = "flush",
+	[EV_PAUSE] = "pause",
+	[EV_RESUME] = "resume",
+	[EV_ERROR] = "error",
+};
+
+/* what a and b mean for each type of event */
+static const char *const eventArgs[] = {
+	[EV_READ] = "bytes=%d\n",
+	[EV_COMMAND] = "cmd=%d value=%lld\n",
+	[EV_ENQUEUE] = "cmd=%d depth=%lld\n",
+	[EV_DEQUEUE] = "cmd=%d waited_us=%lld\n",
+	[EV_SYNTH] = "error=%d us=%lld\n",
+	[EV_FLUSH] = "depth=%d\n",
+	[EV_PAUSE] = "\n",
+	[EV_RESUME] = "\n",
+	[EV_ERROR] = "kind=%d code=%lld\n",
+};
+
+static struct flight_event_t ring[FLIGHT_EVENTS];
+static unsigned long next_seq = 0;
+static long long last_error_dump = 0;
+
+/* where the ring is dumped */
+char *flightPath = "/var/run/espeakup.flight";
+
+void recorder_log(enum flight_event_type_t type, int a, long long b)
+{
+	unsigned long seq;
+	struct flight_event_t *ev;
+
+	seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+	ev = &ring[seq % FLIGHT_EVENTS];
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->t = now_ns();
+	ev->type = type;
+	ev->a = a;
+	ev->b = b;
+	__atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void recorder_dump(const char *reason)
+{
+	struct flight_event_t ev;
+	unsigned long seq, end;
+	long long now = now_ns();
+	time_t wall = time(NULL);
+	FILE *f;
+
+	f = fopen(flightPath, "w");
+	if (!f) {
+		perror("Unable to open the flight recorder file");
+		return;
+	}
+	fprintf(f, "# espeakup flight recorder, dumped on %s at %s", reason,
+			ctime(&wall));
+	fprintf(f, "# seconds before the dump, event, details\n");
+
+	end = __atomic_load_n(&next_seq, __ATOMIC_ACQUIRE);
+	seq = end > FLIGHT_EVENTS ? end - FLIGHT_EVENTS : 0;
+	for (; seq < end; seq++) {
+		struct flight_event_t *slot = &ring[seq % FLIGHT_EVENTS];
+
+		ev.seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		ev.t = slot->t;
+		ev.type = slot->type;
+		ev.a = slot->a;
+		ev.b = slot->b;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* Skip slots being written or already reused. */
+		if (ev.seq != seq + 1
+			|| __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != ev.seq)
+			continue;
+		if (ev.type < 0 || ev.type >= EV_COUNT)
+			continue;
+		fprintf(f, "-%.6f %-8s ", (now - ev.t) / 1e9, eventNames[ev.type]);
+		fprintf(f, eventArgs[ev.type], ev.a, ev.b);
+	}
+	fclose(f);
+}
+
+/* Dump after an error, unless we did so very recently. */
+void recorder_dump_on_error(void)
+{
+	long long now = now_ns();
+
+	if (last_error_dump
+		&& now - last_error_dump < errorDumpInterval * 1000000000LL)
+		return;
+	last_error_dump = now;
+	recorder_dump("error");
+}
@@ -0,0 +1,387 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline rendering, --render.
+ *
+ * Files of what speakup (or acsint with --acsint) would send are parsed
+ * the way the softsynth thread parses them, and spoken by the calling
+ * thread, with the audio going to a WAV file as fast as it is
+ * synthesized rather than at the pace of a device.  Several files are
+ * rendered by as many processes as there are CPUs, one file each.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "engine.h"
+#include "espeakup.h"
+#include "stringhandling.h"
+
+int render_mode = 0;
+
+/* WAV file to write, or directory to write them in for several inputs */
+char *renderOutput = NULL;
+
+/* what speakup can hand us in one read, as in softsynth.c */
+static const size_t renderPieceSize = 16 * 1024;
+
+/* synth flush character */
+static const int synthFlushChar = 0x18;
+
+static int read_input(int fd, char **buf, size_t *len)
+{
+	size_t size = 64 * 1024;
+	ssize_t n;
+
+	*len = 0;
+	*buf = allocMem(size);
+	for (;;) {
+		if (*len == size) {
+			size *= 2;
+			*buf = reallocMem(*buf, size);
+		}
+		n = read(fd, *buf + *len, size - *len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(*buf);
+			return -1;
+		}
+		if (n == 0)
+			return 0;
+		*len += n;
+	}
+}
+
+/*
+ * Feed the input to the parser a read's worth at a time, cut after a
+ * newline when there is one, and speak what each piece queues before
+ * going on to the next.  As on the softsynth, a flush drops the text
+ * before it in the same piece.
+ */
+static void render_input(struct synth_t *s, const char *in, size_t len)
+{
+	char buf[renderPieceSize + 1];
+	size_t n, i;
+	char *cp;
+
+	while (len > 0) {
+		n = len;
+		if (n > renderPieceSize) {
+			n = renderPieceSize;
+			for (i = n; i > 0; i--)
+				if (in[i - 1] == '\n')
+					break;
+			if (i > 0)
+				n = i;
+		}
+		memcpy(buf, in, n);
+		buf[n] = 0;
+		in += n;
+		len -= n;
+
+		cp = memrchr(buf, synthFlushChar, n);
+		if (cp) {
+			n -= cp + 1 - buf;
+			memmove(buf, cp + 1, n + 1);
+		}
+		if (espeakup_mode == ESPEAKUP_MODE_SPEAKUP)
+			process_buffer(s, buf, n);
+		else
+			process_buffer_acsint(s, buf, n);
+		speak_queue(s);
+	}
+	/* acsint text which was not ended by a newline */
+	if (espeakup_mode == ESPEAKUP_MODE_ACSINT) {
+		flush_acsint_text();
+		speak_queue(s);
+	}
+}
+
+/*
+ * Render one file, "-" being stdin or stdout.  Returns the seconds of
+ * audio written, or a negative value on failure.
+ */
+static double render_file(const char *inPath, const char *outPath)
+{
+	struct synth_t s = {
+		.voice = "",
+	};
+	int inFD = STDIN_FILENO, outFD = STDOUT_FILENO;
+	struct stat inStat, outStat;
+	char *in;
+	size_t len;
+	double seconds = -1;
+
+	if (strcmp(inPath, "-")) {
+		inFD = open(inPath, O_RDONLY);
+		if (inFD < 0) {
+			fprintf(stderr, "Unable to open %s: %s\n", inPath,
+					strerror(errno));
+			return -1;
+		}
+	}
+	if (read_input(inFD, &in, &len) < 0) {
+		fprintf(stderr, "Unable to read %s: %s\n", inPath, strerror(errno));
+		goto out_in;
+	}
+	if (strcmp(outPath, "-")) {
+		/* x.wav renders to x.wav, which would truncate it. */
+		if (fstat(inFD, &inStat) == 0 && stat(outPath, &outStat) == 0
+			&& inStat.st_dev == outStat.st_dev
+			&& inStat.st_ino == outStat.st_ino) {
+			fprintf(stderr, "Unable to render %s over itself\n", inPath);
+			goto out_buf;
+		}
+		outFD = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (outFD < 0) {
+			fprintf(stderr, "Unable to create %s: %s\n", outPath,
+					strerror(errno));
+			goto out_buf;
+		}
+	}
+
+	audio_open_file(outFD);
+	initialize_volume(&s);
+	if (initialize_espeak(&s) < 0) {
+		audio_close_file();
+		goto out_out;
+	}
+	render_input(&s, in, len);
+	seconds = audio_close_file();
+	engine->terminate();
+
+out_out:
+	if (outFD != STDOUT_FILENO)
+		close(outFD);
+out_buf:
+	free(in);
+out_in:
+	if (inFD != STDIN_FILENO)
+		close(inFD);
+	return seconds;
+}
+
+static void report(const char *what, double audio, double wall)
+{
+	fprintf(stderr, "%s: %.1f s of audio in %.2f s, %.1fx realtime\n",
+			what, audio, wall, wall > 0 ? audio / wall : 0);
+}
+
+/*
+ * The WAV file for an input: its name with .wav for its extension, in
+ * the renderOutput directory if there is one.
+ */
+static char *output_path(const char *inPath)
+{
+	const char *base, *dot;
+	char *path;
+	int n;
+
+	base = strrchr(inPath, '/');
+	base = base ? base + 1 : inPath;
+	dot = strrchr(base, '.');
+	if (!dot || dot == base)
+		dot = base + strlen(base);
+	if (renderOutput)
+		n = asprintf(&path, "%s/%.*s.wav", renderOutput,
+					 (int) (dot - base), base);
+	else
+		n = asprintf(&path, "%.*s.wav", (int) (dot - inPath), inPath);
+	return n < 0 ? NULL : path;
+}
+
+/*
+ * An output path with its directory resolved, so that two paths to the
+ * same file, like a.wav and ./a.wav, compare equal although it may not
+ * exist yet.
+ */
+static char *resolve_output(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir, *real, *resolved;
+	int n = -1;
+
+	dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+	real = dir ? realpath(dir, NULL) : NULL;
+	if (real)
+		n = asprintf(&resolved, "%s/%s", real, slash ? slash + 1 : path);
+	free(dir);
+	free(real);
+	return n < 0 ? NULL : resolved;
+}
+
+/*
+ * The outputs of the inputs, NULL for those which cannot be rendered
+ * with the others: stdin, and those whose output an earlier input
+ * already has, like a.md's after a.txt's.
+ */
+static char **output_paths(int count, char **paths)
+{
+	char **outs = allocMem(count * sizeof(*outs));
+	char **resolved = allocMem(count * sizeof(*resolved));
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		outs[i] = strcmp(paths[i], "-") ? output_path(paths[i]) : NULL;
+		resolved[i] = outs[i] ? resolve_output(outs[i]) : NULL;
+		if (!outs[i] || !resolved[i]) {
+			fprintf(stderr, "Unable to render %s with other files\n",
+					paths[i]);
+			goto skip;
+		}
+		for (j = 0; j < i; j++)
+			if (resolved[j] && !strcmp(resolved[i], resolved[j])) {
+				fprintf(stderr, "Unable to render %s to %s, which %s "
+						"is rendered to\n", paths[i], outs[i], paths[j]);
+				goto skip;
+			}
+		continue;
+skip:
+		free(outs[i]);
+		free(resolved[i]);
+		outs[i] = resolved[i] = NULL;
+	}
+	for (i = 0; i < count; i++)
+		free(resolved[i]);
+	free(resolved);
+	return outs;
+}
+
+/* Collect what the children have reported so far. */
+static double collect(int fd)
+{
+	double audio, total = 0;
+
+	while (read(fd, &audio, sizeof(audio)) == sizeof(audio))
+		total += audio;
+	return total;
+}
+
+/*
+ * Render several files, one process per CPU, each reporting the seconds
+ * of audio it wrote through a pipe.
+ */
+static int render_parallel(int count, char **paths)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long long start = now_ns();
+	double audio = 0, seconds;
+	int fds[2];
+	int running = 0, failed = 0;
+	int i, status;
+	char **outs;
+	pid_t pid;
+
+	if (cpus < 1)
+		cpus = 1;
+	if (pipe2(fds, O_NONBLOCK) < 0) {
+		perror("Unable to create pipe");
+		return 5;
+	}
+	/* Before forking, for no two children to write the same file. */
+	outs = output_paths(count, paths);
+	for (i = 0; i < count || running > 0;) {
+		if (i < count && running < cpus) {
+			if (!outs[i]) {
+				failed++;
+				i++;
+				continue;
+			}
+			fflush(stderr);
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				if (!running)
+					return 4;
+			} else if (pid == 0) {
+				start = now_ns();
+				seconds = render_file(paths[i], outs[i]);
+				if (seconds < 0)
+					_exit(1);
+				report(paths[i], seconds, (now_ns() - start) / 1e9);
+				(void)write(fds[1], &seconds, sizeof(seconds));
+				_exit(0);
+			} else {
+				running++;
+				i++;
+				continue;
+			}
+		}
+		if (wait(&status) < 0)
+			break;
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+		audio += collect(fds[0]);
+	}
+	close(fds[1]);
+	audio += collect(fds[0]);
+	close(fds[0]);
+	for (i = 0; i < count; i++)
+		free(outs[i]);
+	free(outs);
+
+	fprintf(stderr, "%d files on %ld processes", count - failed, cpus);
+	report("", audio, (now_ns() - start) / 1e9);
+	if (failed)
+		fprintf(stderr, "%d files failed\n", failed);
+	return failed ? 1 : 0;
+}
+
+/*
+ * Render the files named on the command line, or stdin when there are
+ * none.  Returns the exit status.
+ */
+int render_files(int count, char **paths)
+{
+	char *stdinPath = "-";
+	char *out;
+	long long start;
+	double seconds;
+
+	if (count > 1)
+		return render_parallel(count, paths);
+	if (count == 0)
+		paths = &stdinPath;
+
+	if (renderOutput)
+		out = strdup(renderOutput);
+	else if (!strcmp(paths[0], "-"))
+		out = strdup("-");
+	else
+		out = output_path(paths[0]);
+	if (!out) {
+		fprintf(stderr, "Unable to allocate memory.\n");
+		return 2;
+	}
+	start = now_ns();
+	seconds = render_file(paths[0], out);
+	free(out);
+	if (seconds < 0)
+		return 1;
+	report(paths[0], seconds, (now_ns() - start) / 1e9);
+	return 0;
+}
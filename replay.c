@@ -0,0 +1,268 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * espeakup-replay: feed a capture made with espeakup --record back to
+ * espeakup.
+ *
+ *   espeakup-replay [options] capture [path]
+ *   espeakup-replay [options] capture -- command [args...]
+ *
+ * The capture is written to path, e.g. a FIFO espeakup reads with
+ * --device, or to standard output for acsint mode.  Given a command
+ * instead, a pty is set up, {} in the arguments is replaced with the
+ * path of its slave side, and the command is run and stopped with
+ * SIGTERM once the capture has been replayed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "record.h"
+
+/* how much faster than recorded to replay, as fast as possible if 0 */
+static double speed = 1.0;
+
+/* how long to leave espeakup alone before and after replaying, in ms */
+static int settleMs = 500;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: espeakup-replay [options] capture [path]\n");
+	fprintf(stderr, "       espeakup-replay [options] capture -- command [args...]\n\n");
+	fprintf(stderr, "Options are as follows:\n");
+	fprintf(stderr, "  -s speed\tReplay speed times faster than recorded.\n");
+	fprintf(stderr, "  -f\t\tReplay as fast as possible.\n");
+	fprintf(stderr, "  -w ms\t\tWait before and after replaying (default 500).\n");
+	exit(2);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Open a raw pty, returning the master and the path of the slave. */
+static int open_pty(char **slave_path, int *slave_fd)
+{
+	struct termios tio;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("Unable to set up a pty");
+		return -1;
+	}
+	*slave_path = strdup(ptsname(master));
+	/* Keep the slave open, so that the pty lasts until we are done. */
+	*slave_fd = open(*slave_path, O_RDWR | O_NOCTTY);
+	if (*slave_fd < 0 || tcgetattr(*slave_fd, &tio) < 0) {
+		perror("Unable to open the pty");
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(*slave_fd, TCSANOW, &tio);
+	return master;
+}
+
+static pid_t run_command(char **argv, const char *slave_path)
+{
+	pid_t pid;
+	int i;
+
+	for (i = 0; argv[i]; i++)
+		if (!strcmp(argv[i], "{}"))
+			argv[i] = (char *) slave_path;
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int replay(FILE *capture, int fd)
+{
+	struct record_header_t hdr;
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned long records = 0, bytes = 0;
+	long long start, late, max_late = 0;
+
+	start = now_ns();
+	while (fread(&hdr, sizeof(hdr), 1, capture) == 1) {
+		if (hdr.len > size) {
+			size = hdr.len;
+			buf = realloc(buf, size);
+			if (!buf) {
+				perror("Unable to allocate memory");
+				return -1;
+			}
+		}
+		if (fread(buf, 1, hdr.len, capture) != hdr.len) {
+			fprintf(stderr, "Truncated capture\n");
+			break;
+		}
+		if (speed > 0) {
+			long long t = start + (long long) (hdr.t_ns / speed);
+
+			sleep_until(t);
+			late = now_ns() - t;
+			if (late > max_late)
+				max_late = late;
+		}
+		if (write_all(fd, buf, hdr.len) < 0) {
+			perror("Unable to write to espeakup");
+			free(buf);
+			return -1;
+		}
+		records++;
+		bytes += hdr.len;
+	}
+	free(buf);
+	fprintf(stderr, "Replayed %lu reads, %lu bytes in %.3f s", records,
+			bytes, (now_ns() - start) / 1e9);
+	if (speed > 0)
+		fprintf(stderr, ", at most %.3f ms late", max_late / 1e6);
+	fprintf(stderr, "\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char magic[sizeof(RECORD_MAGIC) - 1];
+	char *slave_path = NULL;
+	FILE *capture;
+	int fd = STDOUT_FILENO, slave_fd = -1;
+	pid_t pid = -1;
+	int opt, status, rc;
+
+	while ((opt = getopt(argc, argv, "+fs:w:")) != -1) {
+		switch (opt) {
+		case 'f':
+			speed = 0;
+			break;
+		case 's':
+			speed = atof(optarg);
+			if (speed < 0)
+				usage();
+			break;
+		case 'w':
+			settleMs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	capture = fopen(argv[optind], "r");
+	if (!capture) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(magic, sizeof(magic), 1, capture) != 1
+		|| memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s is not an espeakup capture\n", argv[optind]);
+		return 1;
+	}
+	optind++;
+
+	if (optind < argc && !strcmp(argv[optind], "--")) {
+		if (++optind >= argc)
+			usage();
+		fd = open_pty(&slave_path, &slave_fd);
+		if (fd < 0)
+			return 1;
+		pid = run_command(argv + optind, slave_path);
+		if (pid < 0)
+			return 1;
+	} else if (optind < argc) {
+		fd = open(argv[optind], O_WRONLY);
+		if (fd < 0) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	/* Let espeakup start before the clock starts ticking. */
+	usleep(settleMs * 1000);
+	rc = replay(capture, fd) < 0;
+	fclose(capture);
+	if (pid < 0)
+		return rc;
+
+	usleep(settleMs * 1000);
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return 1;
+	}
+	close(fd);
+	close(slave_fd);
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "espeakup was killed by signal %d\n",
+				WTERMSIG(status));
+		return 1;
+	}
+	return rc || WEXITSTATUS(status);
+}
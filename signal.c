@@ -25,6 +25,18 @@
 
 #include "espeakup.h"
 
+/* speak what is queued before exiting, rather than dropping it */
+int drainOnExit = 0;
+
+/* time from SIGTERM by which espeakup is to have exited */
+int shutdownTimeoutMs = 1000;
+
+/* set while the queue is being drained, see main() */
+volatile int shutdown_drain = 0;
+
+/* when we were asked to exit or upgrade, CLOCK_MONOTONIC, in ns */
+long long shutdown_start = 0;
+
 /*
  * We install a dummy signal handler to let the o/s know that we
  * do not want the default action to be performed since we are
@@ -44,8 +56,11 @@ void *signal_thread(void *arg)
 	/* install dummy handlers for the signals we want to process */
 	temp.sa_handler = dummy_handler;
 	sigemptyset(&temp.sa_mask);
+	sigaction(SIGHUP, &temp, NULL);
 	sigaction(SIGINT, &temp, NULL);
 	sigaction(SIGTERM, &temp, NULL);
+	sigaction(SIGUSR1, &temp, NULL);
+	sigaction(SIGUSR2, &temp, NULL);
 
 	pthread_mutex_lock(&queue_guard);
 	while (should_run) {
@@ -56,9 +71,26 @@ void *signal_thread(void *arg)
 		case SIGINT:
 		case SIGTERM:
 			pthread_mutex_lock(&queue_guard);
+			shutdown_start = now_ns();
+			shutdown_drain = drainOnExit;
 			should_run = 0;
+			pthread_cond_signal(&runner_awake);
+			/* The reader may be waiting for espeak to stop. */
+			pthread_cond_broadcast(&stop_acknowledged);
 			pthread_mutex_unlock(&queue_guard);
 			break;
+		case SIGHUP:
+			pthread_mutex_lock(&queue_guard);
+			if (request_upgrade() == 0)
+				shutdown_start = handover_start;
+			pthread_mutex_unlock(&queue_guard);
+			break;
+		case SIGUSR1:
+			latency_dump();
+			break;
+		case SIGUSR2:
+			recorder_dump("request");
+			break;
 		default:
 			printf("espeakup caught signal %d\n", sig);
 			break;
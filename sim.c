@@ -0,0 +1,989 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The simulator: the pipeline's threads run in virtual time, against a
+ * fake espeak and the null audio device, so that timing-sensitive
+ * scenarios run the same way every time and their latencies can be
+ * checked.  "make sim" builds espeakup-sim and runs every scenario.
+ *
+ * espeakup-sim is linked with everything but espeakup.o and clock.o,
+ * this file providing the clock and espeak, and with the pthread calls
+ * the pipeline makes, select() and write() wrapped (see SIM_WRAP in the
+ * Makefile).  The wrappers make the threads take turns: only one runs
+ * at a time, until it blocks on a mutex, a condition, select() or the
+ * clock, and then the next runnable one, in a fixed order, gets to run.
+ * When none can, the virtual clock jumps to the earliest wakeup.  So
+ * nothing depends on the host's scheduler or speed, and time only
+ * passes when the pipeline waits for it.
+ *
+ * Each scenario runs twice, in a child process of its own, and the two
+ * runs must give the same timeline.
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "espeakup.h"
+
+#define SIM_THREADS 64
+#define SIM_MUTEXES 16
+#define SIM_BLOCKS 65536
+#define SIM_UTTERANCES 1024
+#define SIM_MARKS 1024
+
+#define MS 1000000LL
+
+/* the virtual clock starts here, so that 0 still means no time */
+static const long long simEpoch = 1000 * MS;
+
+/* a scenario still running after this much real time has hung */
+static const int simTimeoutSec = 30;
+
+static int verbose = 0;
+
+/*
+ * The scheduler.
+ */
+enum sim_state_t {
+	T_RUNNABLE,
+	T_WAITING,
+	T_DONE,
+};
+
+struct sim_thread_t {
+	pthread_t id;
+	sem_t run;					/* posted when it is its turn */
+	enum sim_state_t state;
+	const void *wait_on;		/* what it waits for */
+	long long wake_at;			/* when its wait times out, 0 for never */
+	unsigned long wait_seq;		/* for waking waiters in order */
+	int timed_out;
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static struct sim_thread_t threads[SIM_THREADS];
+static int nthreads = 1;		/* the main thread is 0 */
+static __thread int self = 0;
+static unsigned long wait_seq = 0;
+static long long sim_now;
+
+/* waited on by threads in select(), woken by every write() */
+static int io_event;
+
+static void fail(const char *msg)
+{
+	fprintf(stderr, "sim: %s at %.3f ms\n", msg, (sim_now - simEpoch) / 1e6);
+	exit(3);
+}
+
+static void wake_all(const void *obj)
+{
+	int i;
+
+	for (i = 0; i < nthreads; i++)
+		if (threads[i].state == T_WAITING && threads[i].wait_on == obj) {
+			threads[i].state = T_RUNNABLE;
+			threads[i].wait_on = NULL;
+			threads[i].wake_at = 0;
+		}
+}
+
+static void wake_one(const void *obj)
+{
+	struct sim_thread_t *first = NULL;
+	int i;
+
+	for (i = 0; i < nthreads; i++)
+		if (threads[i].state == T_WAITING && threads[i].wait_on == obj
+			&& (!first || threads[i].wait_seq < first->wait_seq))
+			first = &threads[i];
+	if (first) {
+		first->state = T_RUNNABLE;
+		first->wait_on = NULL;
+		first->wake_at = 0;
+	}
+}
+
+/* The next runnable thread after the current one, if any. */
+static int pick_next(void)
+{
+	int k, i;
+
+	for (k = 1; k <= nthreads; k++) {
+		i = (self + k) % nthreads;
+		if (threads[i].state == T_RUNNABLE)
+			return i;
+	}
+	return -1;
+}
+
+/* Move the clock to the earliest timeout, and wake who was waiting. */
+static void advance_clock(void)
+{
+	long long next = 0;
+	int i;
+
+	for (i = 0; i < nthreads; i++)
+		if (threads[i].state == T_WAITING && threads[i].wake_at
+			&& (!next || threads[i].wake_at < next))
+			next = threads[i].wake_at;
+	if (!next)
+		return;
+	if (next > sim_now)
+		sim_now = next;
+	for (i = 0; i < nthreads; i++)
+		if (threads[i].state == T_WAITING && threads[i].wake_at
+			&& threads[i].wake_at <= sim_now) {
+			threads[i].state = T_RUNNABLE;
+			threads[i].wait_on = NULL;
+			threads[i].wake_at = 0;
+			threads[i].timed_out = 1;
+		}
+}
+
+/* Hand over to the next thread, and wait for our turn to come again. */
+static void schedule(void)
+{
+	struct sim_thread_t *me = &threads[self];
+	int next;
+
+	next = pick_next();
+	if (next < 0) {
+		advance_clock();
+		next = pick_next();
+	}
+	if (next < 0)
+		fail("deadlock, every thread is waiting");
+	if (next == self)
+		return;
+	sem_post(&threads[next].run);
+	if (me->state == T_DONE)
+		return;
+	while (sem_wait(&me->run) < 0 && errno == EINTR);
+}
+
+/* Wait for obj to be woken, or until wake_at.  Returns 1 on timeout. */
+static int block(const void *obj, long long wake_at)
+{
+	struct sim_thread_t *me = &threads[self];
+
+	me->state = T_WAITING;
+	me->wait_on = obj;
+	me->wake_at = wake_at;
+	me->wait_seq = ++wait_seq;
+	me->timed_out = 0;
+	schedule();
+	return me->timed_out;
+}
+
+static void *thread_start(void *arg)
+{
+	struct sim_thread_t *me;
+	void *ret;
+
+	self = (long) arg;
+	me = &threads[self];
+	while (sem_wait(&me->run) < 0 && errno == EINTR);
+	ret = me->fn(me->arg);
+	me->state = T_DONE;
+	wake_all(me);
+	schedule();
+	return ret;
+}
+
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+						  void *(*fn)(void *), void *arg);
+int __real_pthread_join(pthread_t thread, void **ret);
+int __real_select(int nfds, fd_set *r, fd_set *w, fd_set *e,
+				  struct timeval *tv);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+						  void *(*fn)(void *), void *arg)
+{
+	struct sim_thread_t *t;
+	int err;
+
+	if (nthreads == SIM_THREADS)
+		fail("too many threads");
+	t = &threads[nthreads];
+	sem_init(&t->run, 0, 0);
+	t->state = T_RUNNABLE;
+	t->fn = fn;
+	t->arg = arg;
+	err = __real_pthread_create(&t->id, attr, thread_start,
+								(void *) (long) nthreads);
+	if (err)
+		return err;
+	nthreads++;
+	*thread = t->id;
+	return 0;
+}
+
+int __wrap_pthread_join(pthread_t thread, void **ret)
+{
+	int i;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_equal(threads[i].id, thread))
+			break;
+	if (i == nthreads)
+		return ESRCH;
+	while (threads[i].state != T_DONE)
+		block(&threads[i], 0);
+	return __real_pthread_join(thread, ret);
+}
+
+/*
+ * Mutexes are only ever contended when their owner is waiting for
+ * something else, so they are kept here rather than in the real mutex.
+ */
+static struct {
+	const void *mutex;
+	int owner;
+} mutexes[SIM_MUTEXES];
+
+static int *mutex_owner(const void *m)
+{
+	int i;
+
+	for (i = 0; i < SIM_MUTEXES && mutexes[i].mutex; i++)
+		if (mutexes[i].mutex == m)
+			return &mutexes[i].owner;
+	if (i == SIM_MUTEXES)
+		fail("too many mutexes");
+	mutexes[i].mutex = m;
+	mutexes[i].owner = -1;
+	return &mutexes[i].owner;
+}
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t *m)
+{
+	int *owner = mutex_owner(m);
+
+	if (*owner == self)
+		fail("recursive lock");
+	while (*owner >= 0)
+		block(m, 0);
+	*owner = self;
+	return 0;
+}
+
+int __wrap_pthread_mutex_trylock(pthread_mutex_t *m)
+{
+	int *owner = mutex_owner(m);
+
+	if (*owner >= 0)
+		return EBUSY;
+	*owner = self;
+	return 0;
+}
+
+int __wrap_pthread_mutex_unlock(pthread_mutex_t *m)
+{
+	int *owner = mutex_owner(m);
+
+	if (*owner != self)
+		fail("unlock of a mutex which is not ours");
+	*owner = -1;
+	wake_all(m);
+	return 0;
+}
+
+int __wrap_pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+	__wrap_pthread_mutex_unlock(m);
+	block(c, 0);
+	return __wrap_pthread_mutex_lock(m);
+}
+
+/* Deadlines are on the virtual clock. */
+int __wrap_pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+								  const struct timespec *abstime)
+{
+	long long t = abstime->tv_sec * 1000000000LL + abstime->tv_nsec;
+	int timed_out;
+
+	__wrap_pthread_mutex_unlock(m);
+	timed_out = block(c, t > sim_now ? t : sim_now);
+	__wrap_pthread_mutex_lock(m);
+	return timed_out ? ETIMEDOUT : 0;
+}
+
+int __wrap_pthread_cond_signal(pthread_cond_t *c)
+{
+	wake_one(c);
+	return 0;
+}
+
+int __wrap_pthread_cond_broadcast(pthread_cond_t *c)
+{
+	wake_all(c);
+	return 0;
+}
+
+/* Poll, and wait for the next write() when nothing is ready. */
+int __wrap_select(int nfds, fd_set *r, fd_set *w, fd_set *e,
+				  struct timeval *tv)
+{
+	fd_set r0, w0, e0;
+	struct timeval zero;
+	long long deadline = 0;
+	int n;
+
+	if (tv)
+		deadline = sim_now + tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+	for (;;) {
+		if (r)
+			r0 = *r;
+		if (w)
+			w0 = *w;
+		if (e)
+			e0 = *e;
+		zero.tv_sec = zero.tv_usec = 0;
+		n = __real_select(nfds, r ? &r0 : NULL, w ? &w0 : NULL,
+						  e ? &e0 : NULL, &zero);
+		if (n != 0 || (tv && sim_now >= deadline))
+			break;
+		block(&io_event, deadline);
+	}
+	if (r)
+		*r = r0;
+	if (w)
+		*w = w0;
+	if (e)
+		*e = e0;
+	return n;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	ssize_t n = __real_write(fd, buf, count);
+
+	wake_all(&io_event);
+	return n;
+}
+
+/* The clock, instead of clock.c. */
+long long now_ns(void)
+{
+	return sim_now;
+}
+
+void sleep_until_ns(long long t)
+{
+	if (t > sim_now)
+		block(&sim_now, t);
+}
+
+/*
+ * The fake espeak.  It takes synthStartMs to start on a text, then
+ * makes chunks of the length espeak was initialized with, each taking
+ * 1 / realtimeFactor of its length to make, with a WORD event at the
+ * start of each word.  Words last as long as the rate says.
+ */
+static const int simSampleRate = 22050;
+static const int synthStartMs = 8;
+static const int realtimeFactor = 20;
+
+static t_espeak_callback *synth_cb;
+static int chunk_ms = 20;
+static int words_per_minute = 175;
+
+struct utterance_t {
+	char text[64];
+	long long at;
+};
+
+static struct utterance_t utterances[SIM_UTTERANCES];
+static int nutterances = 0;
+static int current_utterance = -1;
+
+struct mark_t {
+	long long at;
+	int param;
+	int value;
+};
+
+static struct mark_t params[SIM_MARKS];
+static int nparams = 0;
+
+int espeak_Initialize(espeak_AUDIO_OUTPUT output, int buflength,
+					  const char *path, int options)
+{
+	if (buflength > 0)
+		chunk_ms = buflength;
+	return simSampleRate;
+}
+
+void espeak_SetSynthCallback(t_espeak_callback *cb)
+{
+	synth_cb = cb;
+}
+
+espeak_ERROR espeak_SetParameter(espeak_PARAMETER parameter, int value,
+								 int relative)
+{
+	if (parameter == espeakRATE)
+		words_per_minute = value > 80 ? value : 80;
+	if (nparams < SIM_MARKS) {
+		params[nparams].at = sim_now;
+		params[nparams].param = parameter;
+		params[nparams].value = value;
+		nparams++;
+	}
+	return EE_OK;
+}
+
+int espeak_GetParameter(espeak_PARAMETER parameter, int current)
+{
+	return 0;
+}
+
+static espeak_VOICE simVoice = { "english", "\x05" "en\0", "en" };
+static const espeak_VOICE *simVoices[] = { &simVoice, NULL };
+
+const espeak_VOICE **espeak_ListVoices(espeak_VOICE *spec)
+{
+	return simVoices;
+}
+
+espeak_ERROR espeak_SetVoiceByName(const char *name)
+{
+	return strcmp(name, simVoice.name) ? EE_NOT_FOUND : EE_OK;
+}
+
+espeak_ERROR espeak_SetVoiceByProperties(espeak_VOICE *spec)
+{
+	return EE_OK;
+}
+
+espeak_ERROR espeak_Cancel(void)
+{
+	return EE_OK;
+}
+
+espeak_ERROR espeak_Terminate(void)
+{
+	return EE_OK;
+}
+
+/* There are no data files to map. */
+const char *espeak_Info(const char **path_data)
+{
+	if (path_data)
+		*path_data = NULL;
+	return "sim";
+}
+
+static void record_utterance(const char *text, unsigned int flags)
+{
+	struct utterance_t *u;
+	int i = 0, tag = 0;
+
+	if (nutterances == SIM_UTTERANCES)
+		fail("too many utterances");
+	u = &utterances[nutterances];
+	/* Keep what would be said, without the SSML. */
+	for (; *text && i < (int) sizeof(u->text) - 1; text++) {
+		if ((flags & espeakSSML) && *text == '<')
+			tag = 1;
+		else if (tag && *text == '>')
+			tag = 0;
+		else if (!tag)
+			u->text[i++] = *text;
+	}
+	u->text[i] = 0;
+	u->at = sim_now;
+	current_utterance = nutterances++;
+}
+
+espeak_ERROR espeak_Synth(const void *text, size_t size,
+						  unsigned int position,
+						  espeak_POSITION_TYPE position_type,
+						  unsigned int end_position, unsigned int flags,
+						  unsigned int *unique_identifier, void *user_data)
+{
+	const char *t;
+	int chunk = simSampleRate * chunk_ms / 1000;
+	short wav[chunk];
+	espeak_EVENT events[2];
+	int i, c, chunks, word = 0;
+
+	record_utterance(text, flags);
+	t = utterances[current_utterance].text;
+	for (i = 0; i < chunk; i++)
+		wav[i] = (i % 50 - 25) * 400;
+	sleep_until_ns(sim_now + synthStartMs * MS);
+	for (i = 0; t[i];) {
+		while (t[i] == ' ')
+			i++;
+		if (!t[i])
+			break;
+		memset(events, 0, sizeof(events));
+		events[0].type = espeakEVENT_WORD;
+		events[0].text_position = i + 1;
+		word = i;
+		while (t[i] && t[i] != ' ')
+			i++;
+		events[0].length = i - word;
+		chunks = 60000 / words_per_minute / chunk_ms;
+		for (c = 0; c < chunks; c++) {
+			sleep_until_ns(sim_now + chunk_ms * MS / realtimeFactor);
+			if (synth_cb(wav, chunk, c ? events + 1 : events))
+				goto out;
+		}
+	}
+	memset(events, 0, sizeof(events));
+	events[0].type = espeakEVENT_MSG_TERMINATED;
+	synth_cb(NULL, 0, events);
+out:
+	current_utterance = -1;
+	return EE_OK;
+}
+
+/*
+ * What the null sink played, through its tap.
+ */
+struct block_t {
+	long long handed;			/* when the sink was given it */
+	long long start;
+	long long end;
+	int utterance;
+};
+
+static struct block_t blocks[SIM_BLOCKS];
+static int nblocks = 0;
+static long long drops[SIM_MARKS];
+static int ndrops = 0;
+
+static void sim_tap(const short *wav, int n, long long when, int rate)
+{
+	if (!n) {
+		if (ndrops < SIM_MARKS)
+			drops[ndrops++] = when;
+		return;
+	}
+	if (nblocks == SIM_BLOCKS)
+		fail("too much audio");
+	blocks[nblocks].handed = sim_now;
+	blocks[nblocks].start = when;
+	blocks[nblocks].end = when + n * 1000000000LL / rate;
+	blocks[nblocks].utterance = current_utterance;
+	nblocks++;
+}
+
+/*
+ * When a block stopped playing, given the drops: a drop after it was
+ * handed over cuts it, or throws it away if it had not started.
+ */
+static long long block_end(const struct block_t *b)
+{
+	int i;
+
+	for (i = 0; i < ndrops; i++)
+		if (drops[i] >= b->handed && drops[i] < b->end)
+			return drops[i] > b->start ? drops[i] : b->start;
+	return b->end;
+}
+
+/*
+ * Whether an utterance is what we look for: "=text" for exactly text,
+ * otherwise anything containing it.
+ */
+static int utterance_matches(int u, const char *what)
+{
+	if (u < 0)
+		return 0;
+	if (what[0] == '=')
+		return !strcmp(utterances[u].text, what + 1);
+	return strstr(utterances[u].text, what) != NULL;
+}
+
+/* When what was first heard at or after t, -1 if never. */
+static long long first_heard(const char *what, long long t)
+{
+	int i;
+
+	for (i = 0; i < nblocks; i++)
+		if (blocks[i].start >= t && utterance_matches(blocks[i].utterance, what)
+			&& block_end(&blocks[i]) > blocks[i].start)
+			return blocks[i].start;
+	return -1;
+}
+
+/* When what was last heard, -1 if never. */
+static long long last_heard(const char *what)
+{
+	long long last = -1, end;
+	int i;
+
+	for (i = 0; i < nblocks; i++) {
+		if (!utterance_matches(blocks[i].utterance, what))
+			continue;
+		end = block_end(&blocks[i]);
+		if (end > blocks[i].start && end > last)
+			last = end;
+	}
+	return last;
+}
+
+/* When a parameter was first set to value at or after t, -1 if never. */
+static long long param_set(int param, int value, long long t)
+{
+	int i;
+
+	for (i = 0; i < nparams; i++)
+		if (params[i].at >= t && params[i].param == param
+			&& params[i].value == value)
+			return params[i].at;
+	return -1;
+}
+
+/* A fingerprint of the timeline, to check that runs are the same. */
+static unsigned long timeline_hash(void)
+{
+	unsigned long h = 14695981039346656037UL;
+	int i;
+
+#define MIX(v) (h = (h ^ (unsigned long) (v)) * 1099511628211UL)
+	for (i = 0; i < nblocks; i++) {
+		MIX(blocks[i].start);
+		MIX(blocks[i].utterance);
+	}
+	for (i = 0; i < ndrops; i++)
+		MIX(drops[i]);
+	for (i = 0; i < nparams; i++) {
+		MIX(params[i].at);
+		MIX(params[i].value);
+	}
+#undef MIX
+	return h;
+}
+
+static void dump_timeline(void)
+{
+	int i, d = 0, p = 0, last = -2;
+
+	for (i = 0; i <= nblocks; i++) {
+		long long t = i < nblocks ? blocks[i].start : -1;
+
+		for (; d < ndrops && (t < 0 || drops[d] <= t); d++)
+			fprintf(stderr, "%10.3f drop\n", (drops[d] - simEpoch) / 1e6);
+		for (; p < nparams && (t < 0 || params[p].at <= t); p++)
+			fprintf(stderr, "%10.3f param %d = %d\n",
+					(params[p].at - simEpoch) / 1e6, params[p].param,
+					params[p].value);
+		if (i < nblocks && blocks[i].utterance != last) {
+			last = blocks[i].utterance;
+			fprintf(stderr, "%10.3f play \"%s\"\n", (t - simEpoch) / 1e6,
+					last >= 0 ? utterances[last].text : "?");
+		}
+	}
+}
+
+/*
+ * Scenarios.  They type to the pipeline and wait on the virtual clock,
+ * then check what was heard.  Times are in ms from the start.
+ */
+static int device_fd;
+static int failures;
+
+static long long at_ms(long long ms)
+{
+	return simEpoch + ms * MS;
+}
+
+static void wait_until_ms(long long ms)
+{
+	sleep_until_ns(at_ms(ms));
+}
+
+static void type(const char *text)
+{
+	if (write(device_fd, text, strlen(text)) < 0)
+		fail("unable to write to the device");
+}
+
+/* Check that something took no longer than limit ms. */
+static void expect_within(const char *what, long long from, long long to,
+						  int limit)
+{
+	double ms = (to - from) / 1e6;
+
+	if (to < 0) {
+		printf("  FAIL %s: never happened\n", what);
+		failures++;
+	} else if (ms > limit) {
+		printf("  FAIL %s: %.3f ms, limit %d ms\n", what, ms, limit);
+		failures++;
+	} else
+		printf("  ok   %s: %.3f ms\n", what, ms);
+}
+
+static void expect(const char *what, int cond)
+{
+	printf("  %s %s\n", cond ? "ok  " : "FAIL", what);
+	if (!cond)
+		failures++;
+}
+
+static const char bulkText[] =
+	"A bulk line to be read. Another bulk line follows it. The bulk of "
+	"the text goes on for a while longer, so that there is plenty left "
+	"to speak when it gets interrupted. More bulk words keep coming.\n";
+
+static void scenario_key_echo(void)
+{
+	wait_until_ms(100);
+	type("k");
+	wait_until_ms(1000);
+	expect_within("key to sound", at_ms(100), first_heard("=k", 0), 40);
+}
+
+static void scenario_flush_during_bulk(void)
+{
+	type(bulkText);
+	wait_until_ms(1000);
+	type("\x18");
+	wait_until_ms(1100);
+	type("k");
+	wait_until_ms(2000);
+	expect("bulk text was heard", first_heard("bulk", 0) >= 0);
+	expect_within("flush to silence", at_ms(1000), last_heard("bulk"), 25);
+	expect_within("key to sound", at_ms(1100), first_heard("=k", 0), 40);
+}
+
+static void scenario_flush_during_pause_during_read_all(void)
+{
+	int i;
+
+	type("Short line.\x01P");
+	/* Paused, and flushed while paused. */
+	wait_until_ms(1000);
+	type("\x18");
+	/* Read all sends the screen a line at a time. */
+	for (i = 0; i < 3; i++) {
+		wait_until_ms(1100 + i * 300);
+		type(bulkText);
+	}
+	wait_until_ms(1800);
+	type("\x18");
+	wait_until_ms(1900);
+	type("k");
+	wait_until_ms(3000);
+	expect("the line before the pause was heard",
+		   first_heard("Short", 0) >= 0);
+	expect_within("resume to sound", at_ms(1100), first_heard("bulk", 0),
+				  40);
+	expect_within("flush to silence", at_ms(1800), last_heard("bulk"), 25);
+	expect_within("key to sound", at_ms(1900), first_heard("=k", 0), 40);
+}
+
+static void scenario_live_rate(void)
+{
+	type(bulkText);
+	wait_until_ms(500);
+	/* rate 7, see set_rate */
+	type("\x01" "7s");
+	wait_until_ms(1500);
+	expect_within("rate change applied", at_ms(500),
+				  param_set(espeakRATE, 7 * 41 + 80, at_ms(500)), 40);
+	expect("speech went on", first_heard("bulk", at_ms(600)) >= 0);
+}
+
+static void scenario_typing_over_bulk(void)
+{
+	char key[3] = "\x18" "a";
+	char what[3] = "=a";
+	long long worst = 0, heard;
+	int i;
+
+	/* A flush then the key, as speakup sends it. */
+	for (i = 0; i < 10; i++) {
+		type(bulkText);
+		wait_until_ms(i * 400 + 300);
+		key[1] = 'a' + i;
+		type(key);
+		wait_until_ms(i * 400 + 400);
+	}
+	for (i = 0; i < 10; i++) {
+		what[1] = 'a' + i;
+		heard = first_heard(what, at_ms(i * 400 + 300));
+		if (heard < 0) {
+			worst = -1;
+			break;
+		}
+		if (heard - at_ms(i * 400 + 300) > worst)
+			worst = heard - at_ms(i * 400 + 300);
+	}
+	expect_within("worst key to sound", 0, worst, 40);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} scenarios[] = {
+	{"key_echo", scenario_key_echo},
+	{"flush_during_bulk", scenario_flush_during_bulk},
+	{"flush_during_pause_during_read_all",
+	 scenario_flush_during_pause_during_read_all},
+	{"live_rate", scenario_live_rate},
+	{"typing_over_bulk", scenario_typing_over_bulk},
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* Run a scenario in this process, which is a fresh child. */
+static void run_scenario(int n, int report)
+{
+	struct synth_t s = {
+		.voice = "",
+	};
+	pthread_t softsynth_thread_id, espeak_thread_id;
+	static char path[32];
+	int fds[2];
+
+	alarm(simTimeoutSec);
+	sim_now = simEpoch;
+	synth_queue = new_queue();
+	live_queue = new_queue();
+	if (pipe(self_pipe_fds) < 0 || pipe(fds) < 0) {
+		perror("Unable to create pipe");
+		exit(3);
+	}
+	/* The softsynth is the read end of a pipe. */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[0]);
+	softsynthPath = path;
+	device_fd = fds[1];
+	audioDevice = "null";
+	audio_tap = sim_tap;
+	if (open_softsynth() < 0)
+		exit(3);
+	initialize_volume(&s);
+	pthread_create(&softsynth_thread_id, NULL, softsynth_thread, &s);
+	pthread_create(&espeak_thread_id, NULL, espeak_thread, &s);
+	if (wait_for_espeak() < 0)
+		exit(3);
+
+	printf("%s\n", scenarios[n].name);
+	scenarios[n].run();
+	if (verbose && report)
+		dump_timeline();
+	printf("  timeline %016lx\n", timeline_hash());
+	fflush(stdout);
+	_exit(failures ? 1 : 0);
+}
+
+/* Run a scenario in a child, returning its status and timeline. */
+static int run_child(int n, int report, unsigned long *hash)
+{
+	int fds[2], status;
+	char buf[4096];
+	ssize_t len;
+	pid_t pid;
+	char *p;
+
+	fflush(stdout);
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(3);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(3);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		run_scenario(n, report);
+	}
+	close(fds[1]);
+	len = 0;
+	while (len < (ssize_t) sizeof(buf) - 1) {
+		ssize_t r = read(fds[0], buf + len, sizeof(buf) - 1 - len);
+
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	buf[len] = 0;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	*hash = 0;
+	p = strstr(buf, "  timeline ");
+	if (p) {
+		*hash = strtoul(p + 11, NULL, 16);
+		*p = 0;
+	}
+	if (report)
+		fputs(buf, stdout);
+	if (WIFSIGNALED(status)) {
+		printf("  FAIL killed by signal %d%s\n", WTERMSIG(status),
+			   WTERMSIG(status) == SIGALRM ? ", it hung" : "");
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long first, second;
+	int failed = 0, ran = 0;
+	unsigned int i;
+	int j, opt;
+
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		if (opt != 'v') {
+			fprintf(stderr, "Usage: espeakup-sim [-v] [scenario...]\n");
+			return 2;
+		}
+		verbose = 1;
+	}
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], scenarios[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		ran++;
+		if (run_child(i, 1, &first)) {
+			failed++;
+			continue;
+		}
+		run_child(i, 0, &second);
+		if (first != second) {
+			printf("  FAIL two runs gave different timelines\n");
+			failed++;
+		}
+	}
+	printf("%d of %d scenarios passed\n", ran - failed, ran);
+	return failed ? 1 : 0;
+}
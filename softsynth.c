@@ -23,10 +23,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "espeakup.h"
+#include "probes.h"
+#include "record.h"
 #include "stringhandling.h"
 
 /* max buffer size */
@@ -37,11 +40,35 @@ static const int synthFlushChar = 0x18;
 
 static int softFD = 0;
 
-/* Text accumulator: */
-char *textAccumulator;
-int textAccumulator_l;
+/* device to read from instead of the speakup softsynth, if any */
+char *softsynthPath = NULL;
 
-static void queue_add_cmd(enum command_t cmd, enum adjust_t adj, int value)
+/* file to record what is read from the softsynth to, if any */
+char *recordPath = NULL;
+static int recordFD = -1;
+static long long record_start;
+
+/* when the data being processed was read */
+static long long read_stamp;
+
+/*
+ * acsint text, waiting for a line break, a command, or acsintFlushMs
+ * without anything more being read, to be spoken.  Its allocation is
+ * kept from one line to the next.
+ */
+static struct strbuf_t textAccumulator;
+static long long text_last_read;
+
+/* idle time after which acsint text is spoken, in ms; 0 to wait */
+int acsintFlushMs = 150;
+
+/*
+ * Live commands go to live_queue, which the espeak thread looks at
+ * before anything in synth_queue, and make it interrupt the text it is
+ * speaking so that they are heard right away.
+ */
+static void queue_add_cmd(enum command_t cmd, enum adjust_t adj, int value,
+						  int live)
 {
 	struct espeak_entry_t *entry;
 	int added = 0;
@@ -50,8 +77,21 @@ static void queue_add_cmd(enum command_t cmd, enum adjust_t adj, int value)
 	entry->cmd = cmd;
 	entry->adjust = adj;
 	entry->value = value;
+	memset(entry->stamp, 0, sizeof(entry->stamp));
+	entry->stamp[STAMP_READ] = read_stamp;
+	entry->stamp[STAMP_ENQUEUE] = now_ns();
 	pthread_mutex_lock(&queue_guard);
-	added = queue_add(synth_queue, (void *) entry);
+	if (live) {
+		added = queue_add(live_queue, (void *) entry);
+		if (added)
+			restart_requested = 1;
+	} else {
+		added = queue_add(synth_queue, (void *) entry);
+		if (added)
+			stats_entry_added(entry);
+	}
+	PROBE3(enqueue, cmd, 0, stats.queue_depth);
+	recorder_log(EV_ENQUEUE, cmd, stats.queue_depth);
 	if (!added)
 		free(entry);
 	else
@@ -74,23 +114,39 @@ static void queue_add_text(char *txt, size_t length)
 		return;
 	}
 	entry->len = length;
+	memset(entry->stamp, 0, sizeof(entry->stamp));
+	entry->stamp[STAMP_READ] = read_stamp;
+	entry->stamp[STAMP_ENQUEUE] = now_ns();
 	pthread_mutex_lock(&queue_guard);
 	added = queue_add(synth_queue, (void *) entry);
 	if (!added) {
 		free(entry->buf);
 		free(entry);
 	} else {
+		stats_entry_added(entry);
 		pthread_cond_signal(&runner_awake);
 	}
+	PROBE3(enqueue, CMD_SPEAK_TEXT, length, stats.queue_depth);
+	recorder_log(EV_ENQUEUE, CMD_SPEAK_TEXT, stats.queue_depth);
 
 	pthread_mutex_unlock(&queue_guard);
 }
 
-static int process_command(struct synth_t *s, char *buf, int start)
+/* Queue the acsint text accumulated so far. */
+void flush_acsint_text(void)
+{
+	if (!textAccumulator.l)
+		return;
+	queue_add_text(textAccumulator.s, textAccumulator.l);
+	strbufClear(&textAccumulator);
+}
+
+static int process_command(struct synth_t *s, char *buf, int start,
+						   int live)
 {
 	char *cp;
-	int value;
-	enum adjust_t adj;
+	int value = 0;
+	enum adjust_t adj = ADJ_SET;
 	enum command_t cmd;
 
 	cp = buf + start;
@@ -133,6 +189,9 @@ static int process_command(struct synth_t *s, char *buf, int start)
 		case 'v':
 			cmd = CMD_SET_VOLUME;
 			break;
+		case 'o':
+			cmd = CMD_SET_VOICE;
+			break;
 		case 'P':
 			cmd = CMD_PAUSE;
 			break;
@@ -148,26 +207,57 @@ static int process_command(struct synth_t *s, char *buf, int start)
 		break;
 	}
 
-	if (cmd != CMD_FLUSH && cmd != CMD_UNKNOWN) {
-		if (espeakup_mode == ESPEAKUP_MODE_ACSINT
-			&& textAccumulator_l != 0) {
-			queue_add_text(textAccumulator, textAccumulator_l);
-			free(textAccumulator);
-			textAccumulator = initString(&textAccumulator_l);
-		}
-		queue_add_cmd(cmd, adj, value);
+	PROBE3(command, cmd, adj, value);
+	recorder_log(EV_COMMAND, cmd, value);
+	if (cmd == CMD_SET_VOLUME) {
+		/* The volume is applied on the fly, it need not wait its turn. */
+		set_volume(s, value, adj);
+	} else if (cmd != CMD_FLUSH && cmd != CMD_UNKNOWN) {
+		if (espeakup_mode == ESPEAKUP_MODE_ACSINT)
+			flush_acsint_text();
+		queue_add_cmd(cmd, adj, value,
+					  live && (cmd == CMD_SET_RATE || cmd == CMD_SET_PITCH));
 	}
 
 	return cp - (buf + start);
 }
 
-static void process_buffer(struct synth_t *s, char *buf, ssize_t length)
+/*
+ * Whether a buffer holds anything to speak, as opposed to only commands.
+ * This follows the parsing done by process_command.
+ */
+static int buffer_has_text(char *buf, ssize_t length)
+{
+	int i = 0;
+
+	while (i < length) {
+		if (buf[i] < 0 || buf[i] >= ' ')
+			return 1;
+		if (buf[i++] != 1)
+			continue;
+		if (i < length && (buf[i] == '+' || buf[i] == '-'))
+			i++;
+		while (i < length && isdigit(buf[i]))
+			i++;
+		i++;
+	}
+	return 0;
+}
+
+void process_buffer(struct synth_t *s, char *buf, ssize_t length)
 {
 	int start;
 	int end;
 	char txtBuf[maxBufferSize];
 	size_t txtLen;
-
+	int live;
+
+	/*
+	 * Settings which speakup sends on their own come from the user
+	 * changing them, and are applied live.  Those which come along with
+	 * text, like the pitch changes around capitals, must stay in order.
+	 */
+	live = !buffer_has_text(buf, length);
 	start = 0;
 	end = 0;
 	while (start < length) {
@@ -180,14 +270,13 @@ static void process_buffer(struct synth_t *s, char *buf, ssize_t length)
 			queue_add_text(txtBuf, txtLen);
 		}
 		if (end < length)
-			start = end = end + process_command(s, buf, end);
+			start = end = end + process_command(s, buf, end, live);
 		else
 			start = length;
 	}
 }
 
-static void process_buffer_acsint(struct synth_t *s, char *buf,
-								  ssize_t length)
+void process_buffer_acsint(struct synth_t *s, char *buf, ssize_t length)
 {
 	int start = 0;
 	int i;
@@ -200,19 +289,16 @@ static void process_buffer_acsint(struct synth_t *s, char *buf,
 			if (buf[i] >= 0 && buf[i] < ' ')
 				break;
 		}
-		if (i > start)
-			stringAndBytes(&textAccumulator, &textAccumulator_l,
-						   buf + start, i - start);
+		if (i > start) {
+			strbufAppend(&textAccumulator, buf + start, i - start);
+			text_last_read = read_stamp;
+		}
 		if (flushIt) {
-			if (textAccumulator != EMPTYSTRING) {
-				queue_add_text(textAccumulator, textAccumulator_l);
-				free(textAccumulator);
-				textAccumulator = initString(&textAccumulator_l);
-			}
+			flush_acsint_text();
 			flushIt = 0;
 		}
 		if (i < length)
-			start = i = i + process_command(s, buf, i);
+			start = i = i + process_command(s, buf, i, 0);
 		else
 			start = length;
 	}
@@ -222,15 +308,65 @@ static void request_espeak_stop(void)
 {
 	pthread_mutex_lock(&queue_guard);
 	stop_requested = 1;
+	stats.flushes++;
+	PROBE(flush_request);
+	recorder_log(EV_FLUSH, stats.queue_depth, 0);
+	/* Until espeak is initialized, there is only the queue to flush. */
+	if (espeak_ready <= 0) {
+		synth_queue_clear();
+		stop_requested = 0;
+	}
 	pthread_cond_signal(&runner_awake);	/* Wake runner, if necessary. */
 	while (should_run && stop_requested)
 		pthread_cond_wait(&stop_acknowledged, &queue_guard);	/* wait for acknowledgement. */
 	pthread_mutex_unlock(&queue_guard);
 }
 
+static int open_record(void)
+{
+	recordFD = open(recordPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					0644);
+	if (recordFD < 0) {
+		perror("Unable to open the record file");
+		return -1;
+	}
+	if (write(recordFD, RECORD_MAGIC, strlen(RECORD_MAGIC)) < 0) {
+		perror("Unable to write to the record file");
+		close(recordFD);
+		recordFD = -1;
+		return -1;
+	}
+	record_start = now_ns();
+	return 0;
+}
+
+/* Append what was just read to the record, see record.h. */
+static void record_read(const char *buf, size_t length)
+{
+	struct record_header_t hdr;
+	struct iovec iov[2];
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.t_ns = read_stamp - record_start;
+	hdr.len = length;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = length;
+	if (writev(recordFD, iov, 2) < 0) {
+		perror("Unable to write to the record file");
+		close(recordFD);
+		recordFD = -1;
+	}
+}
+
 int open_softsynth(void)
 {
 	int rc = 0;
+
+	if (recordPath && open_record() < 0)
+		return -1;
+
 	/* If we're in acsint mode, we read from stdin.  No need to open. */
 	if (espeakup_mode == ESPEAKUP_MODE_ACSINT) {
 		softFD = STDIN_FILENO;
@@ -238,10 +374,14 @@ int open_softsynth(void)
 	}
 
 	/* open the softsynth. */
-	softFD = open("/dev/softsynthu", O_RDWR | O_NONBLOCK);
-	if (softFD < 0 && errno == ENOENT)
-		/* Kernel without unicode support?  Try without unicode.  */
-		softFD = open("/dev/softsynth", O_RDWR | O_NONBLOCK);
+	if (softsynthPath)
+		softFD = open(softsynthPath, O_RDWR | O_NONBLOCK);
+	else {
+		softFD = open("/dev/softsynthu", O_RDWR | O_NONBLOCK);
+		if (softFD < 0 && errno == ENOENT)
+			/* Kernel without unicode support?  Try without unicode.  */
+			softFD = open("/dev/softsynth", O_RDWR | O_NONBLOCK);
+	}
 	if (softFD < 0) {
 		perror("Unable to open the softsynth device");
 		rc = -1;
@@ -249,10 +389,26 @@ int open_softsynth(void)
 	return rc;
 }
 
+/* Take over the softsynth of the espeakup we replaced, see upgrade.c. */
+int adopt_softsynth(int fd)
+{
+	if (recordPath && open_record() < 0)
+		return -1;
+	softFD = fd;
+	return 0;
+}
+
+int softsynth_fd(void)
+{
+	return softFD;
+}
+
 void close_softsynth(void)
 {
 	if (softFD)
 		close(softFD);
+	if (recordFD >= 0)
+		close(recordFD);
 }
 
 void *softsynth_thread(void *arg)
@@ -264,9 +420,10 @@ void *softsynth_thread(void *arg)
 	char *cp;
 	int terminalFD = PIPE_READ_FD;
 	int greatestFD;
+	struct timeval tv, *timeout;
+	long long idle;
 
-	textAccumulator = initString(&textAccumulator_l);
-
+	realtime_thread(REALTIME_NICE);
 	if (terminalFD > softFD)
 		greatestFD = terminalFD;
 	else
@@ -278,7 +435,20 @@ void *softsynth_thread(void *arg)
 		FD_SET(softFD, &set);
 		FD_SET(terminalFD, &set);
 
-		if (select(greatestFD + 1, &set, NULL, NULL, NULL) < 0) {
+		/* acsint text without a line break is spoken once idle. */
+		timeout = NULL;
+		if (textAccumulator.l && acsintFlushMs > 0) {
+			idle = text_last_read + acsintFlushMs * 1000000LL - now_ns();
+			if (idle <= 0)
+				flush_acsint_text();
+			else {
+				tv.tv_sec = idle / 1000000000LL;
+				tv.tv_usec = (idle % 1000000000LL + 999) / 1000;
+				timeout = &tv;
+			}
+		}
+
+		if (select(greatestFD + 1, &set, NULL, NULL, timeout) < 0) {
 			if (errno == EINTR) {
 				pthread_mutex_lock(&queue_guard);
 				continue;
@@ -305,9 +475,16 @@ void *softsynth_thread(void *arg)
 				continue;
 			}
 			perror("Read from softsynth failed");
+			recorder_log(EV_ERROR, FLIGHT_ERR_READ, errno);
 			pthread_mutex_lock(&queue_guard);
+			stats.read_errors++;
 			break;
 		}
+		read_stamp = now_ns();
+		PROBE1(read_done, length);
+		recorder_log(EV_READ, length, 0);
+		if (recordFD >= 0)
+			record_read(buf, length);
 		*(buf + length) = 0;
 		cp = strrchr(buf, synthFlushChar);
 		if (cp) {
@@ -0,0 +1,381 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The stats socket.
+ *
+ * When a path is given with --stats-socket, espeakup listens on a Unix
+ * domain socket there.  A client connects, optionally sends a query
+ * line, and gets the answer before the connection is closed.  With no
+ * query, or "stats", the answer is our figures in the Prometheus text
+ * format, so that e.g.
+ *   socat - UNIX-CONNECT:/run/espeakup.sock > espeakup.prom
+ * feeds a textfile collector.  "voices" lists the available voices, with
+ * the numbers speakup selects them by.
+ *
+ * queue_guard is only held to copy the figures, the answer is built and
+ * written from the copy.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "espeakup.h"
+
+/* how long a client gets to send its query, in milliseconds */
+static const int queryTimeoutMs = 200;
+
+/* path of the stats socket, none when NULL */
+char *statsPath = NULL;
+
+/* figures of the pipeline, protected by queue_guard */
+struct stats_t stats;
+
+static int listenFD = -1;
+
+/* Account for an entry added to synth_queue, with queue_guard held. */
+void stats_entry_added(const struct espeak_entry_t *entry)
+{
+	stats.queue_depth++;
+	if (entry->cmd == CMD_SPEAK_TEXT)
+		stats.queued_bytes += entry->len;
+}
+
+/* Account for an entry taken off synth_queue, with queue_guard held. */
+void stats_entry_removed(const struct espeak_entry_t *entry)
+{
+	stats.queue_depth--;
+	if (entry->cmd == CMD_SPEAK_TEXT)
+		stats.queued_bytes -= entry->len;
+}
+
+struct snapshot_t {
+	struct stats_t stats;
+	struct synth_t synth;
+	long long oldest;
+	int paused;
+};
+
+static void take_snapshot(struct snapshot_t *snap, struct synth_t *s)
+{
+	struct espeak_entry_t *head;
+
+	pthread_mutex_lock(&queue_guard);
+	snap->stats = stats;
+	snap->synth = *s;
+	head = queue_peek(synth_queue);
+	snap->oldest = head ? head->stamp[STAMP_ENQUEUE] : 0;
+	snap->paused = paused_espeak;
+	pthread_mutex_unlock(&queue_guard);
+}
+
+static void metric(FILE *f, const char *name, const char *type,
+				   const char *help)
+{
+	fprintf(f, "# HELP espeakup_%s %s\n", name, help);
+	fprintf(f, "# TYPE espeakup_%s %s\n", name, type);
+}
+
+static void write_stats(FILE *f, struct synth_t *s)
+{
+	static const char *const classes[] = { "interactive", "bulk" };
+	static const char *const stages[] = { "queue", "first_audio", "total" };
+	static const double quantiles[] = { 50, 90, 99, 99.9 };
+	static const char *const startups[] = {
+		"begin", "softsynth", "engine", "ready"
+	};
+	struct snapshot_t snap;
+	unsigned int c, i, q;
+	int resident;
+	long v;
+
+	take_snapshot(&snap, s);
+
+	metric(f, "queue_depth", "gauge", "Entries waiting to be spoken.");
+	fprintf(f, "espeakup_queue_depth %d\n", snap.stats.queue_depth);
+	metric(f, "queue_bytes", "gauge", "Bytes of text waiting to be spoken.");
+	fprintf(f, "espeakup_queue_bytes %ld\n", snap.stats.queued_bytes);
+	metric(f, "queue_oldest_age_seconds", "gauge",
+		   "Time the oldest waiting entry has been queued.");
+	fprintf(f, "espeakup_queue_oldest_age_seconds %.6f\n",
+			snap.oldest ? (now_ns() - snap.oldest) / 1e9 : 0.0);
+
+	metric(f, "setting", "gauge", "Current speakup settings.");
+	fprintf(f, "espeakup_setting{name=\"frequency\"} %d\n",
+			snap.synth.frequency);
+	fprintf(f, "espeakup_setting{name=\"pitch\"} %d\n", snap.synth.pitch);
+	fprintf(f, "espeakup_setting{name=\"punct\"} %d\n", snap.synth.punct);
+	fprintf(f, "espeakup_setting{name=\"rate\"} %d\n", snap.synth.rate);
+	fprintf(f, "espeakup_setting{name=\"volume\"} %d\n", snap.synth.volume);
+	metric(f, "voice_info", "gauge", "Current voice.");
+	fprintf(f, "espeakup_voice_info{voice=\"%s\"} 1\n", snap.synth.voice);
+	metric(f, "voice_switch_seconds", "summary", "Time taken by voice switches.");
+	fprintf(f, "espeakup_voice_switch_seconds_sum %.6f\n",
+			snap.stats.voice_switch_ns / 1e9);
+	fprintf(f, "espeakup_voice_switch_seconds_count %lu\n",
+			snap.stats.voice_switches);
+	metric(f, "voice_switch_max_seconds", "gauge",
+		   "Longest time taken by a voice switch.");
+	fprintf(f, "espeakup_voice_switch_max_seconds %.6f\n",
+			snap.stats.voice_switch_max_ns / 1e9);
+	if (poolVoices || isolateSynth) {
+		metric(f, "worker_restarts_total", "counter",
+			   "Synthesis workers restarted, by why.");
+		fprintf(f, "espeakup_worker_restarts_total{reason=\"lost\"} %lu\n",
+				snap.stats.worker_restarts - snap.stats.worker_hangs);
+		fprintf(f, "espeakup_worker_restarts_total{reason=\"hung\"} %lu\n",
+				snap.stats.worker_hangs);
+		metric(f, "worker_restart_seconds", "summary",
+			   "Time taken to restart a synthesis worker.");
+		fprintf(f, "espeakup_worker_restart_seconds_sum %.6f\n",
+				snap.stats.worker_restart_ns / 1e9);
+		fprintf(f, "espeakup_worker_restart_seconds_count %lu\n",
+				snap.stats.worker_restarts);
+		metric(f, "worker_restart_max_seconds", "gauge",
+			   "Longest time taken to restart a synthesis worker.");
+		fprintf(f, "espeakup_worker_restart_max_seconds %.6f\n",
+				snap.stats.worker_restart_max_ns / 1e9);
+	}
+	if (autoLanguage) {
+		metric(f, "langid_lines_total", "counter",
+			   "Lines looked at by --auto-language, by outcome.");
+		fprintf(f, "espeakup_langid_lines_total{result=\"determined\"} %lu\n",
+				snap.stats.langid_lines - snap.stats.langid_undetermined);
+		fprintf(f, "espeakup_langid_lines_total{result=\"undetermined\"} %lu\n",
+				snap.stats.langid_undetermined);
+		metric(f, "langid_switches_total", "counter",
+			   "Voice switches made by --auto-language.");
+		fprintf(f, "espeakup_langid_switches_total %lu\n",
+				snap.stats.langid_switches);
+		metric(f, "langid_seconds", "summary",
+			   "Time taken identifying the language of lines.");
+		fprintf(f, "espeakup_langid_seconds_sum %.6f\n",
+				snap.stats.langid_ns / 1e9);
+		fprintf(f, "espeakup_langid_seconds_count %lu\n",
+				snap.stats.langid_lines);
+		metric(f, "langid_max_seconds", "gauge",
+			   "Longest time taken identifying the language of a line.");
+		fprintf(f, "espeakup_langid_max_seconds %.6f\n",
+				snap.stats.langid_max_ns / 1e9);
+	}
+	if (snap.stats.handover_ns) {
+		metric(f, "handover_seconds", "gauge",
+			   "Time from SIGHUP to the upgraded espeakup being ready.");
+		fprintf(f, "espeakup_handover_seconds %.6f\n",
+				snap.stats.handover_ns / 1e9);
+	}
+	metric(f, "paused", "gauge", "Whether speech is paused.");
+	fprintf(f, "espeakup_paused %d\n", snap.paused);
+
+	metric(f, "startup_seconds", "gauge",
+		   "Time from start at which each startup phase was done.");
+	for (i = STARTUP_SOFTSYNTH; i < STARTUP_COUNT; i++)
+		if (snap.stats.startup[i])
+			fprintf(f, "espeakup_startup_seconds{phase=\"%s\"} %.6f\n",
+					startups[i], (snap.stats.startup[i]
+								  - snap.stats.startup[STARTUP_BEGIN]) / 1e9);
+
+	/* Only known when the engine's voice data could be mapped. */
+	resident = prewarm_resident();
+	if (resident >= 0) {
+		metric(f, "voice_data_resident_ratio", "gauge",
+			   "Share of the voice data in memory.");
+		fprintf(f, "espeakup_voice_data_resident_ratio %.2f\n",
+				resident / 100.0);
+		metric(f, "first_audio_seconds", "summary",
+			   "Time from taking the first utterance after startup, idle "
+			   "or a pause off the queue to its first audio, by whether "
+			   "the voice data was all in memory.");
+		for (i = 0; i < 2; i++) {
+			fprintf(f, "espeakup_first_audio_seconds_sum{data=\"%s\"} "
+					"%.6f\n", i ? "warm" : "cold",
+					snap.stats.first_audio_ns[i] / 1e9);
+			fprintf(f, "espeakup_first_audio_seconds_count{data=\"%s\"} "
+					"%lu\n", i ? "warm" : "cold",
+					snap.stats.first_utterances[i]);
+		}
+	}
+	if (prewarmMemoryMb) {
+		metric(f, "prewarm_passes_total", "counter",
+			   "Times the voice data was read in to keep it warm.");
+		fprintf(f, "espeakup_prewarm_passes_total %lu\n",
+				__atomic_load_n(&prewarm_passes, __ATOMIC_RELAXED));
+	}
+
+	if (realtimePriority) {
+		metric(f, "realtime_applied", "gauge",
+			   "What --realtime could apply, by feature.");
+		for (i = 0; i < REALTIME_COUNT; i++)
+			fprintf(f, "espeakup_realtime_applied{feature=\"%s\"} %d\n",
+					realtime_names[i], realtime_applied[i]);
+	}
+
+	metric(f, "flushes_total", "counter", "Flushes requested by speakup.");
+	fprintf(f, "espeakup_flushes_total %lu\n", snap.stats.flushes);
+	metric(f, "errors_total", "counter", "Errors, by kind.");
+	fprintf(f, "espeakup_errors_total{kind=\"read\"} %lu\n",
+			snap.stats.read_errors);
+	fprintf(f, "espeakup_errors_total{kind=\"synth\"} %lu\n",
+			snap.stats.synth_errors);
+
+	if (espeakup_mode == ESPEAKUP_MODE_ACSINT) {
+		metric(f, "marks_total", "counter",
+			   "acsint index marks, written or dropped.");
+		fprintf(f, "espeakup_marks_total{state=\"written\"} %lu\n",
+				__atomic_load_n(&marks_written, __ATOMIC_RELAXED));
+		fprintf(f, "espeakup_marks_total{state=\"dropped\"} %lu\n",
+				__atomic_load_n(&marks_dropped, __ATOMIC_RELAXED));
+	}
+
+	metric(f, "latency_seconds", "summary",
+		   "Latency of entries through the pipeline.");
+	for (c = 0; c < LATENCY_CLASSES; c++)
+		for (i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+			for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+				v = latency_percentile(c, stages[i], quantiles[q]);
+				fprintf(f, "espeakup_latency_seconds{class=\"%s\","
+						"stage=\"%s\",quantile=\"%g\"} %.6f\n",
+						classes[c], stages[i], quantiles[q] / 100, v / 1e6);
+			}
+}
+
+/* The voice index, numbered as speakup's voice command selects them. */
+static void write_voices(FILE *f)
+{
+	const struct voice_t *v;
+	int i;
+
+	for (i = 0; (v = get_voice(i)); i++)
+		fprintf(f, "%d\t%s\t%s\t%s\n", i, v->name, v->language,
+				v->identifier);
+}
+
+static void serve_client(int fd, struct synth_t *s)
+{
+	char query[64];
+	fd_set set;
+	struct timeval tv;
+	ssize_t n = 0;
+	FILE *f;
+
+	/* A client which just wants the stats needs not send anything. */
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	tv.tv_sec = 0;
+	tv.tv_usec = queryTimeoutMs * 1000;
+	if (select(fd + 1, &set, NULL, NULL, &tv) > 0)
+		n = read(fd, query, sizeof(query) - 1);
+	if (n < 0)
+		n = 0;
+	query[n] = 0;
+	query[strcspn(query, "\r\n")] = 0;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		return;
+	}
+	if (!query[0] || !strcmp(query, "stats"))
+		write_stats(f, s);
+	else if (!strcmp(query, "voices"))
+		write_voices(f);
+	else
+		fprintf(f, "unknown query: %s\n", query);
+	fclose(f);
+}
+
+int open_stats_socket(void)
+{
+	struct sockaddr_un addr;
+
+	if (!statsPath)
+		return 0;
+	if (strlen(statsPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Stats socket path too long: %s\n", statsPath);
+		return -1;
+	}
+	listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFD < 0) {
+		perror("Unable to create the stats socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, statsPath);
+	unlink(statsPath);
+	if (bind(listenFD, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| listen(listenFD, 4) < 0) {
+		perror("Unable to listen on the stats socket");
+		close(listenFD);
+		listenFD = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void close_stats_socket(void)
+{
+	if (listenFD < 0)
+		return;
+	close(listenFD);
+	listenFD = -1;
+	unlink(statsPath);
+}
+
+void *stats_thread(void *arg)
+{
+	struct synth_t *s = (struct synth_t *) arg;
+	int terminalFD = PIPE_READ_FD;
+	int greatestFD;
+	fd_set set;
+	int fd;
+
+	greatestFD = terminalFD > listenFD ? terminalFD : listenFD;
+	pthread_mutex_lock(&queue_guard);
+	while (should_run) {
+		pthread_mutex_unlock(&queue_guard);
+		FD_ZERO(&set);
+		FD_SET(listenFD, &set);
+		FD_SET(terminalFD, &set);
+		if (select(greatestFD + 1, &set, NULL, NULL, NULL) < 0) {
+			pthread_mutex_lock(&queue_guard);
+			if (errno == EINTR)
+				continue;
+			perror("Select failed");
+			break;
+		}
+		if (FD_ISSET(terminalFD, &set)) {
+			pthread_mutex_lock(&queue_guard);
+			break;
+		}
+		fd = accept(listenFD, NULL, NULL);
+		if (fd >= 0) {
+			/* Don't get stuck on a client which does not read. */
+			struct timeval tv = { 1, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			serve_client(fd, s);
+		}
+		pthread_mutex_lock(&queue_guard);
+	}
+	pthread_mutex_unlock(&queue_guard);
+	return NULL;
+}
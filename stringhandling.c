@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "stringhandling.h"
+
 char *EMPTYSTRING = "";
 
 void *allocMem(size_t n)
@@ -110,3 +112,25 @@ void stringAndBytes(char **s, int *l, const char *t, int cnt)
 	memcpy(p + oldlen, t, cnt);
 	p[oldlen + cnt] = 0;
 }
+
+void strbufAppend(struct strbuf_t *b, const char *t, int cnt)
+{
+	int cap = b->cap ? b->cap : 64;
+
+	while (b->l + cnt + 1 > cap)
+		cap *= 2;
+	if (cap != b->cap) {
+		b->s = b->s ? reallocMem(b->s, cap) : allocMem(cap);
+		b->cap = cap;
+	}
+	memcpy(b->s + b->l, t, cnt);
+	b->l += cnt;
+	b->s[b->l] = 0;
+}
+
+void strbufClear(struct strbuf_t *b)
+{
+	b->l = 0;
+	if (b->s)
+		b->s[0] = 0;
+}
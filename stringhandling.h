@@ -30,4 +30,18 @@ char *initString(int *l);
 void stringAndString(char **s, int *l, const char *t);
 void stringAndBytes(char **s, int *l, const char *t, int cnt);
 
+/*
+ * A string which keeps its allocation when emptied, so that one which
+ * is filled and emptied over and over is only reallocated as it grows.
+ * A zeroed strbuf_t is an empty string.
+ */
+struct strbuf_t {
+	char *s;
+	int l;
+	int cap;
+};
+
+void strbufAppend(struct strbuf_t *b, const char *t, int cnt);
+void strbufClear(struct strbuf_t *b);
+
 #endif
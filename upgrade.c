@@ -0,0 +1,344 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Upgrading in place, on SIGHUP.
+ *
+ * Killing espeakup to start a new one closes the softsynth, and speakup
+ * drops what it sends until it is opened again.  On SIGHUP, espeakup
+ * instead stops its threads, interrupting the text being spoken at the
+ * word being played, and executes the binary it was started from, which
+ * has been replaced in the meantime, with the same arguments and pid.
+ * The softsynth stays open across the exec, and the rest of the text,
+ * what was queued and the current settings go over in a memfd whose
+ * descriptor, with the softsynth's, is in ESPEAKUP_HANDOVER.  The new
+ * espeakup queues them again before anything else it reads, and reports
+ * how long the handover took, from the signal to being ready.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "espeakup.h"
+#include "stringhandling.h"
+
+#define HANDOVER_ENV "ESPEAKUP_HANDOVER"
+#define HANDOVER_MAGIC 0x45535550	/* "ESUP" */
+
+/* default voice, see espeak.c */
+extern char *defaultVoice;
+
+volatile int upgrade_requested = 0;
+
+/* when the handover was asked for, CLOCK_MONOTONIC, in ns */
+long long handover_start = 0;
+
+/* the binary we were started from */
+static char exe_path[4096];
+
+/* the rest of the text being spoken when the handover was asked for */
+static char *kept_text = NULL;
+static int kept_len = 0;
+
+/* what was handed over to us, until restore_handover() queues it */
+static char *handover = NULL;
+static size_t handover_len = 0;
+
+struct handover_header_t {
+	unsigned int magic;
+	long long start;
+	int frequency;
+	int pitch;
+	int punct;
+	int rate;
+	int volume;
+	int paused;
+	char voice[40];
+	int nentries;
+};
+
+/* followed by len bytes of text */
+struct handover_entry_t {
+	int cmd;
+	int adjust;
+	int value;
+	int len;
+};
+
+/* Remember the path of our binary, before it is replaced. */
+void init_upgrade(void)
+{
+	ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+
+	exe_path[n > 0 ? n : 0] = 0;
+}
+
+/*
+ * Ask the threads to stop for a handover, from the signal thread with
+ * queue_guard held.  The text being spoken is interrupted at the word
+ * being played, as for live settings.
+ */
+int request_upgrade(void)
+{
+	if (!exe_path[0] || access(exe_path, X_OK) < 0) {
+		fprintf(stderr, "Unable to upgrade, no binary at %s\n", exe_path);
+		return -1;
+	}
+	handover_start = now_ns();
+	upgrade_requested = 1;
+	should_run = 0;
+	pthread_cond_signal(&runner_awake);
+	pthread_cond_broadcast(&stop_acknowledged);
+	return 0;
+}
+
+/* Keep the rest of the text being spoken, from the espeak thread. */
+void upgrade_keep_text(const char *buf, int len)
+{
+	free(kept_text);
+	kept_text = allocMem(len + 1);
+	memcpy(kept_text, buf, len);
+	kept_text[len] = 0;
+	kept_len = len;
+}
+
+static int put(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int put_entry(int fd, int cmd, int adjust, int value,
+					 const char *text, int len)
+{
+	struct handover_entry_t e = {
+		.cmd = cmd,.adjust = adjust,.value = value,.len = text ? len : 0
+	};
+
+	if (put(fd, &e, sizeof(e)) < 0)
+		return -1;
+	return text ? put(fd, text, len) : 0;
+}
+
+/* Take a queue's entries off it, writing them to the handover. */
+static int put_queue(int fd, struct queue_t *q, int *nentries)
+{
+	struct espeak_entry_t *entry;
+	int rc = 0;
+
+	while ((entry = queue_remove(q))) {
+		if (q == synth_queue)
+			stats_entry_removed(entry);
+		if (rc == 0)
+			rc = put_entry(fd, entry->cmd, entry->adjust, entry->value,
+						   entry->cmd == CMD_SPEAK_TEXT ? entry->buf : NULL,
+						   entry->len);
+		(*nentries)++;
+		if (entry->cmd == CMD_SPEAK_TEXT)
+			free(entry->buf);
+		free(entry);
+	}
+	return rc;
+}
+
+/* Write what the new espeakup needs to go on where we stop. */
+static int write_handover(int fd, struct synth_t *s)
+{
+	struct handover_header_t h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = HANDOVER_MAGIC;
+	h.start = handover_start;
+	h.frequency = s->frequency;
+	h.pitch = s->pitch;
+	h.punct = s->punct;
+	h.rate = s->rate;
+	h.volume = s->volume;
+	h.paused = paused_espeak;
+	snprintf(h.voice, sizeof(h.voice), "%s", s->voice);
+	/* The header is written again once the entries are counted. */
+	if (put(fd, &h, sizeof(h)) < 0)
+		return -1;
+	if (kept_text) {
+		if (put_entry(fd, CMD_SPEAK_TEXT, ADJ_SET, 0, kept_text,
+					  kept_len) < 0)
+			return -1;
+		h.nentries++;
+	}
+	/* Settings waiting in live_queue were meant to go first. */
+	pthread_mutex_lock(&queue_guard);
+	if (put_queue(fd, live_queue, &h.nentries) < 0
+		|| put_queue(fd, synth_queue, &h.nentries) < 0) {
+		pthread_mutex_unlock(&queue_guard);
+		return -1;
+	}
+	pthread_mutex_unlock(&queue_guard);
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		return -1;
+	return lseek(fd, 0, SEEK_SET) < 0 ? -1 : 0;
+}
+
+/*
+ * Execute the new binary, once the threads are stopped and everything
+ * but the softsynth is closed.  Only returns if that fails.
+ */
+void upgrade(char **argv, struct synth_t *s)
+{
+	char env[32];
+	int fd;
+
+	fd = memfd_create("espeakup-handover", 0);
+	if (fd < 0) {
+		perror("Unable to create the handover");
+		return;
+	}
+	if (write_handover(fd, s) < 0) {
+		perror("Unable to write the handover");
+		close(fd);
+		return;
+	}
+	snprintf(env, sizeof(env), "%d,%d", softsynth_fd(), fd);
+	setenv(HANDOVER_ENV, env, 1);
+	close(PIPE_READ_FD);
+	close(PIPE_WRITE_FD);
+	if (debug)
+		fprintf(stderr, "Upgrading to %s\n", exe_path);
+	execv(exe_path, argv);
+	perror("Unable to execute the new espeakup");
+	unsetenv(HANDOVER_ENV);
+	close(fd);
+}
+
+/*
+ * When started by an upgrade, read the handover, returning the softsynth
+ * to take over.  Returns -1 otherwise.
+ */
+int take_handover(void)
+{
+	const struct handover_header_t *h;
+	const char *env = getenv(HANDOVER_ENV);
+	int softfd, fd;
+	struct stat st;
+	void *map;
+
+	if (!env || sscanf(env, "%d,%d", &softfd, &fd) != 2)
+		return -1;
+	unsetenv(HANDOVER_ENV);
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*h)) {
+		fprintf(stderr, "Unable to read the handover\n");
+		close(fd);
+		return softfd;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	h = map;
+	if (map == MAP_FAILED || h->magic != HANDOVER_MAGIC) {
+		fprintf(stderr, "Unable to read the handover\n");
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return softfd;
+	}
+	handover = map;
+	handover_len = st.st_size;
+	handover_start = h->start;
+	return softfd;
+}
+
+static void requeue(enum command_t cmd, enum adjust_t adj, int value,
+					const char *text, int len)
+{
+	struct espeak_entry_t *entry;
+
+	entry = allocMem(sizeof(*entry));
+	memset(entry, 0, sizeof(*entry));
+	entry->cmd = cmd;
+	entry->adjust = adj;
+	entry->value = value;
+	if (cmd == CMD_SPEAK_TEXT) {
+		entry->buf = allocMem(len + 1);
+		memcpy(entry->buf, text, len);
+		entry->buf[len] = 0;
+		entry->len = len;
+	}
+	entry->stamp[STAMP_READ] = entry->stamp[STAMP_ENQUEUE] = now_ns();
+	pthread_mutex_lock(&queue_guard);
+	if (queue_add(synth_queue, entry))
+		stats_entry_added(entry);
+	else {
+		if (cmd == CMD_SPEAK_TEXT)
+			free(entry->buf);
+		free(entry);
+	}
+	pthread_mutex_unlock(&queue_guard);
+}
+
+/*
+ * Go on where the espeakup we replaced stopped, before the threads
+ * start: its voice becomes the default, its volume is set, and its
+ * other settings and what it had left to say are queued.
+ */
+void restore_handover(struct synth_t *s)
+{
+	const struct handover_header_t *h = (const void *) handover;
+	const struct handover_entry_t *e;
+	size_t off = sizeof(*h);
+	int i;
+
+	if (!handover)
+		return;
+	if (h->voice[0]) {
+		free(defaultVoice);
+		defaultVoice = strndup(h->voice, sizeof(h->voice) - 1);
+	}
+	set_volume(s, h->volume, ADJ_SET);
+	requeue(CMD_SET_FREQUENCY, ADJ_SET, h->frequency, NULL, 0);
+	requeue(CMD_SET_PITCH, ADJ_SET, h->pitch, NULL, 0);
+	requeue(CMD_SET_PUNCTUATION, ADJ_SET, h->punct, NULL, 0);
+	requeue(CMD_SET_RATE, ADJ_SET, h->rate, NULL, 0);
+	if (h->paused)
+		requeue(CMD_PAUSE, ADJ_SET, 0, NULL, 0);
+	for (i = 0; i < h->nentries; i++) {
+		if (off + sizeof(*e) > handover_len)
+			break;
+		e = (const void *) (handover + off);
+		off += sizeof(*e);
+		if (e->len < 0 || off + e->len > handover_len)
+			break;
+		requeue(e->cmd, e->adjust, e->value, handover + off, e->len);
+		off += e->len;
+	}
+	munmap(handover, handover_len);
+	handover = NULL;
+}
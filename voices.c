@@ -0,0 +1,156 @@
+/*
+ *  espeakup - interface which allows speakup to use espeak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The voice index.
+ *
+ * The engine's voices are listed once, after it is initialized.  They
+ * are numbered in the order it lists them, which is what speakup's voice
+ * command selects by, and a hash table finds them by name, identifier or
+ * any of their languages, so that switching voices does not have to go
+ * through the engine's own lookups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "espeakup.h"
+#include "stringhandling.h"
+
+static struct voice_t *voices = NULL;
+static int nvoices = 0;
+
+/* open addressing, keys point into voices */
+static struct {
+	const char *key;
+	int voice;
+} *table = NULL;
+static unsigned int table_mask;
+
+/* FNV-1a */
+static unsigned int hash(const char *key)
+{
+	unsigned int h = 2166136261u;
+
+	while (*key)
+		h = (h ^ (unsigned char) *key++) * 16777619u;
+	return h;
+}
+
+/* Add a key for a voice, unless an earlier voice already has it. */
+static void add_key(const char *key, int voice)
+{
+	unsigned int i;
+
+	if (!key || !*key)
+		return;
+	for (i = hash(key) & table_mask; table[i].key; i = (i + 1) & table_mask)
+		if (!strcmp(table[i].key, key))
+			return;
+	table[i].key = key;
+	table[i].voice = voice;
+}
+
+/*
+ * Count the languages of an espeak voice: a priority byte, then the name
+ * of the language, for each, and a 0 priority at the end.
+ */
+static int count_languages(const char *languages)
+{
+	int n = 0;
+
+	while (languages && *languages) {
+		languages += strlen(languages + 1) + 2;
+		n++;
+	}
+	return n;
+}
+
+/* Build the voice index from the engine's list of voices. */
+int load_voices(void)
+{
+	const espeak_VOICE **list;
+	const char *lang;
+	unsigned int size = 16;
+	int keys = 0;
+	int i;
+
+	if (table)
+		return nvoices;
+	list = engine->list_voices();
+	for (nvoices = 0; list && list[nvoices]; nvoices++)
+		keys += 2 + count_languages(list[nvoices]->languages);
+	voices = allocMem((nvoices ? nvoices : 1) * sizeof(*voices));
+	while (size < 2 * keys)
+		size *= 2;
+	table = calloc(size, sizeof(*table));
+	if (!table) {
+		perror("Unable to allocate the voice index");
+		return -1;
+	}
+	table_mask = size - 1;
+
+	for (i = 0; i < nvoices; i++) {
+		voices[i].name = strdup(list[i]->name ? list[i]->name : "");
+		voices[i].identifier = strdup(list[i]->identifier ?
+									  list[i]->identifier : "");
+		/* espeak lists the languages in order of preference */
+		lang = list[i]->languages;
+		voices[i].language = strdup(lang && *lang ? lang + 1 : "");
+		if (!voices[i].name || !voices[i].identifier
+			|| !voices[i].language) {
+			perror("Unable to allocate the voice index");
+			return -1;
+		}
+		add_key(voices[i].name, i);
+		add_key(voices[i].identifier, i);
+	}
+	/* A language goes to the first voice which lists it. */
+	for (i = 0; i < nvoices; i++)
+		for (lang = list[i]->languages; lang && *lang;
+			 lang += strlen(lang + 1) + 2)
+			if (find_voice(lang + 1) < 0)
+				add_key(strdup(lang + 1), i);
+	return nvoices;
+}
+
+/* Number of the voice with this name, identifier or language, or -1. */
+int find_voice(const char *name)
+{
+	unsigned int i;
+
+	if (!table)
+		return -1;
+	for (i = hash(name) & table_mask; table[i].key; i = (i + 1) & table_mask)
+		if (!strcmp(table[i].key, name))
+			return table[i].voice;
+	return -1;
+}
+
+const struct voice_t *get_voice(int n)
+{
+	if (n < 0 || n >= nvoices)
+		return NULL;
+	return &voices[n];
+}
+
+int voice_count(void)
+{
+	return nvoices;
+}